@@ -9,6 +9,18 @@ See documentation here: https://www.raylib.com/, and examples here: https://www.
 #include "raygui.h"
 #include "game.h"
 #include "vector"
+#include "algorithm"
+#include "atomic"
+#include "thread"
+#include "mutex"
+#include "condition_variable"
+#if defined(__AVX2__)
+#define NARROWPHASE_AVX2
+#include "immintrin.h"
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NARROWPHASE_SSE
+#include "emmintrin.h"
+#endif
 
 const unsigned int TARGET_FPS = 50; //frames/second
 int ballType = 0;
@@ -23,7 +35,40 @@ Vector2 launchPosition = { 500, 500 };
 enum physicsShape
 {
 	CIRCLE,
-	HALFSPACE
+	HALFSPACE,
+	SHAPE_COUNT
+};
+
+//Category bits a body can be in, a pair only collides when each body's mask includes the other's category
+enum collisionLayer
+{
+	LAYER_DEFAULT = 1 << 0,
+	LAYER_GROUND = 1 << 1,
+	LAYER_DEBRIS = 1 << 2
+};
+
+enum continuousCollisionType
+{
+	CCD_NONE,
+	CCD_SWEPT,
+	CCD_SPECULATIVE
+};
+
+enum broadphaseType
+{
+	BRUTE_FORCE,
+	SPATIAL_GRID,
+	SWEEP_AND_PRUNE,
+	AABB_TREE,
+	NEIGHBOR_LIST
+};
+
+//How broadphase circle pairs reach the narrowphase
+enum narrowphaseType
+{
+	NARROWPHASE_SEQUENTIAL, //Test and resolve one pair at a time
+	NARROWPHASE_SCALAR, //Batched kernel, scalar reference
+	NARROWPHASE_SIMD //Batched kernel, 4 or 8 pairs per instruction
 };
 
 class physicsSimulation
@@ -32,24 +77,387 @@ public:
 	Vector2 gravAccel = { 0, 90 };
 	float deltaTime = 1.0f / TARGET_FPS; //seconds/frame
 	float time = 0.0f;
+	int stepCount = 0; //Bumped at the end of update(), once positions are final for the frame
 	Vector2 gravity = { launchSpeed * (float)cos(launchAngle * DEG2RAD), -launchSpeed * (float)sin(launchAngle * DEG2RAD) };
-	class physicsBody
+	int broadphase = SPATIAL_GRID; //int so GuiToggleGroup can write to it
+	float collisionTime = 0.0f; //milliseconds spent in collision() last step
+	float solverTime = 0.0f; //milliseconds spent in solveContacts() last step
+	int pairsTested = 0;
+	int pairsFiltered = 0;
+	bool pairScheduling = false; //Leave separated pairs out of the narrowphase until they could have met
+	int pairsSkipped = 0;
+	int solverIterations = 4;
+	bool warmStarting = true;
+	int continuousCollision = CCD_SWEPT;
+	float ccdMotionThreshold = 0.5f; //Bodies moving further than this fraction of their radius per step get swept
+	float ccdSlop = 0.5f; //Bodies are advanced this far into each other so the discrete pass sees a contact
+	float ccdTime = 0.0f;
+	int ccdHits = 0;
+	int speculativeContacts = 0;
+	bool parallelBroadphase = true;
+	int narrowphase = NARROWPHASE_SEQUENTIAL; //The batched kernels are opt-in, their results differ, see batchedNarrowphase()
+	bool verifyNarrowphase = false; //Also run the scalar kernel and count records the SIMD kernel disagrees on. Not batched against sequential
+	float narrowphaseTime = 0.0f; //milliseconds spent in the batched kernel last step
+	int narrowphaseMismatches = 0;
+	class physicsBody;
+
+	//What game code keeps instead of a physicsBody pointer. index names a handleTable entry and generation has
+	//to match it, so a handle to a removed body resolves to nullptr rather than dangling.
+	struct bodyHandle
+	{
+		int index = -1;
+		unsigned int generation = 0;
+	};
+
+	//The one place that maps handles to body addresses. Bodies stay put in their pool slots, so stores and body
+	//lists can swap, sort or compact freely underneath. Freed entries are chained and reused with the generation
+	//bumped, so stale handles never match the new occupant.
+	class handleTable
+	{
+	private:
+		struct entry
+		{
+			physicsBody* body;
+			unsigned int generation;
+			int nextFree;
+		};
+		std::vector<entry> entries;
+		int freeList = -1;
+	public:
+		bodyHandle create(physicsBody* body)
+		{
+			int index = freeList;
+			if (index == -1)
+			{
+				index = entries.size();
+				entries.push_back({ nullptr, 1, -1 });
+			}
+			else
+				freeList = entries[index].nextFree;
+			entries[index].body = body;
+			return { index, entries[index].generation };
+		}
+
+		void destroy(bodyHandle handle)
+		{
+			if (!resolve(handle))
+				return;
+			entry& freed = entries[handle.index];
+			freed.body = nullptr;
+			freed.generation++;
+			freed.nextFree = freeList;
+			freeList = handle.index;
+		}
+
+		physicsBody* resolve(bodyHandle handle)
+		{
+			if (handle.index < 0 || handle.index >= entries.size() || entries[handle.index].generation != handle.generation)
+				return nullptr;
+			return entries[handle.index].body;
+		}
+	};
+	handleTable handles;
+
+	//Bump allocator for one-step scratch whose size is known before it is filled: the batched narrowphase's
+	//gathered arrays and records, sensor query results and the Morton reorder's sort buffers. The candidate pairs,
+	//shape buckets and solver contacts grow as they are found, so they stay persistent vectors that keep their
+	//capacity instead. reset() at the top of update() rewinds the offset, nothing is destructed, so only trivially
+	//destructible types belong here. A request that doesn't fit is served from an overflow block so it never
+	//fails; the next reset frees those and regrows the main block to the high-water mark, so a steady workload
+	//settles into one block, no allocations and a constant-time reset.
+	class frameArena
+	{
+	private:
+		unsigned char* block = nullptr;
+		size_t blockSize = 0;
+		size_t offset = 0;
+		std::vector<unsigned char*> overflow;
+		size_t overflowBytes = 0;
+	public:
+		size_t highWater = 0; //Most bytes any one step has asked for, the size to preallocate
+
+		frameArena() = default;
+		frameArena(const frameArena&) = delete;
+		frameArena& operator=(const frameArena&) = delete;
+		~frameArena()
+		{
+			reset();
+			delete[] block;
+		}
+
+		size_t used() { return offset + overflowBytes; }
+		size_t capacity() { return blockSize; }
+
+		void* allocate(size_t bytes, size_t alignment)
+		{
+			size_t base = (size_t)block;
+			size_t start = (base + offset + alignment - 1) & ~(alignment - 1);
+			if (block && start + bytes <= base + blockSize)
+			{
+				offset = start + bytes - base;
+				return (void*)start;
+			}
+			unsigned char* extra = new unsigned char[bytes + alignment];
+			overflow.push_back(extra);
+			overflowBytes += bytes;
+			return (void*)(((size_t)extra + alignment - 1) & ~(alignment - 1));
+		}
+
+		template<typename T>
+		T* allocate(int count)
+		{
+			return (T*)allocate(count * sizeof(T), alignof(T));
+		}
+
+		void reset()
+		{
+			if (used() > highWater)
+				highWater = used();
+			offset = 0;
+			if (overflow.empty())
+				return;
+			for (int i = 0; i < overflow.size(); i++)
+				delete[] overflow[i];
+			overflow.clear();
+			overflowBytes = 0;
+			//Alignment padding comes out of the block too, leave some room for it
+			delete[] block;
+			blockSize = highWater + highWater / 8 + 256;
+			block = new unsigned char[blockSize];
+		}
+	};
+	frameArena arena;
+
+	//Hot per-body data for one shape type in parallel arrays, so the integration loops stream through memory
+	//instead of visiting every body object. A body owns one slot; releasing it moves the last slot into the
+	//hole and tells that slot's owner where it went.
+	class bodyStore
 	{
 	public:
+		std::vector<Vector2> position;
+		std::vector<Vector2> velocity;
+		std::vector<Vector2> netForce;
+		std::vector<float> mass;
+		std::vector<float> invMass; //0 for static bodies
+		std::vector<float> timeOfImpact; //Fraction of this step's motion applyKinematics() may use, set by continuousCollision()
+		std::vector<physicsBody*> owner;
+
+		int size()
+		{
+			return owner.size();
+		}
+
+		int acquire(physicsBody* body)
+		{
+			position.push_back({ 0, 0 });
+			velocity.push_back({ 0, 0 });
+			netForce.push_back({ 0, 0 });
+			mass.push_back(1);
+			invMass.push_back(1);
+			timeOfImpact.push_back(1);
+			owner.push_back(body);
+			return owner.size() - 1;
+		}
+
+		void release(int slot);
+		void arrange(const std::vector<physicsBody*>& bodies);
+
+	private:
+		std::vector<int> gatherFrom;
+		std::vector<Vector2> vectorScratch;
+		std::vector<float> floatScratch;
+		std::vector<physicsBody*> ownerScratch;
+
+		template<typename T>
+		void gather(std::vector<T>& values, std::vector<T>& scratch)
+		{
+			scratch.resize(gatherFrom.size());
+			for (int i = 0; i < gatherFrom.size(); i++)
+				scratch[i] = values[gatherFrom[i]];
+			values.swap(scratch);
+		}
+	};
+	bodyStore bodies[SHAPE_COUNT];
+
+	//Cold data lives in the object, the motion state is a view into the body's bodyStore slot
+	class physicsBody
+	{
+	private:
+		physicsShape shape;
 		bool staticBody = false;
-		float mass = 1;
-		Vector2 position = { 0, 0 };
-		Vector2 velocity = { 0, 0 };
+		bodyStore* store;
+		int slot;
+		friend class bodyStore;
+	public:
+		unsigned int id = 0; //Assigned by addBody(), starts at 1 so 0 never names a real body
+		bodyHandle handle; //Also assigned by addBody(), goes stale in removeBody()
+		unsigned int collisionCategory = LAYER_DEFAULT;
+		unsigned int collisionMask = 0xFFFFFFFF;
+		bool sensor = false; //Reports overlaps through overlapEvents but gets no collision response
 		Vector2 drag = { 0, 0 };
 		Color color = GREEN;
-		Vector2 netForce = { 0, 0 };
+		int treeProxy = -1; //Leaf node in the aabbTree broadphase, -1 when not inserted
+		int disturbedStep = -1; //Last step something besides gravity changed its motion, see skipScheduledPair()
+		bool pendingRemoval = false; //Marked by removeBody(), freed by the next flushRemovals()
+
+		//stores is the simulation's bodies array, the body takes a slot in the one for its shape
+		physicsBody(physicsShape conShape, bodyStore* stores)
+		{
+			shape = conShape;
+			store = &stores[conShape];
+			slot = store->acquire(this);
+		}
+		physicsBody(const physicsBody&) = delete;
+		physicsBody& operator=(const physicsBody&) = delete;
+		virtual ~physicsBody()
+		{
+			store->release(slot);
+		}
+
+		Vector2& position() { return store->position[slot]; }
+		Vector2& velocity() { return store->velocity[slot]; }
+		Vector2& netForce() { return store->netForce[slot]; }
+		float& timeOfImpact() { return store->timeOfImpact[slot]; }
+		float getMass() { return store->mass[slot]; }
+		float inverseMass() { return store->invMass[slot]; }
+		bool isStatic() { return staticBody; }
+
+		void setMass(float newMass)
+		{
+			store->mass[slot] = newMass;
+			store->invMass[slot] = staticBody ? 0 : 1 / newMass;
+		}
+
+		void setStatic(bool isStatic)
+		{
+			staticBody = isStatic;
+			setMass(getMass());
+		}
+
 		virtual void draw()
 		{
-			DrawText("Nothing to draw here!", position.x, position.y, 5, RED);
+			DrawText("Nothing to draw here!", position().x, position().y, 5, RED);
 		};
 
-		virtual physicsShape Shape() = 0;
+		//Plain field rather than a virtual so the collision loops never go through the vtable
+		physicsShape Shape() { return shape; }
+	};
+};
+
+//Swap-and-pop, the body that owned the last slot is repointed at the hole
+void physicsSimulation::bodyStore::release(int slot)
+{
+	int last = owner.size() - 1;
+	if (slot != last)
+	{
+		position[slot] = position[last];
+		velocity[slot] = velocity[last];
+		netForce[slot] = netForce[last];
+		mass[slot] = mass[last];
+		invMass[slot] = invMass[last];
+		timeOfImpact[slot] = timeOfImpact[last];
+		owner[slot] = owner[last];
+		owner[slot]->slot = slot;
+	}
+	position.pop_back();
+	velocity.pop_back();
+	netForce.pop_back();
+	mass.pop_back();
+	invMass.pop_back();
+	timeOfImpact.pop_back();
+	owner.pop_back();
+}
+
+//Moves every slot so the store follows the order its bodies appear in bodies, which may also hold bodies of
+//other shapes. Left untouched if some body in the store is missing from the list.
+void physicsSimulation::bodyStore::arrange(const std::vector<physicsBody*>& bodies)
+{
+	gatherFrom.clear();
+	for (int i = 0; i < bodies.size(); i++)
+	{
+		if (bodies[i]->store == this)
+			gatherFrom.push_back(bodies[i]->slot);
+	}
+	if (gatherFrom.size() != owner.size())
+		return;
+	gather(position, vectorScratch);
+	gather(velocity, vectorScratch);
+	gather(netForce, vectorScratch);
+	gather(mass, floatScratch);
+	gather(invMass, floatScratch);
+	gather(timeOfImpact, floatScratch);
+	gather(owner, ownerScratch);
+	for (int i = 0; i < owner.size(); i++)
+		owner[i]->slot = i;
+}
+
+physicsSimulation physicsSimulationObject;
+
+//Fixed-size slots carved out of slabs that are never handed back to the heap. Free slots are chained through
+//their own storage, so acquire and release are O(1) and steady-state spawning never touches the allocator.
+template<size_t SlotSize, size_t SlotAlign, int SlotsPerSlab = 1024>
+class slabPool
+{
+private:
+	union slot
+	{
+		slot* next;
+		alignas(SlotAlign) unsigned char storage[SlotSize];
 	};
+	std::vector<slot*> slabs;
+	slot* freeList = nullptr;
+	int live = 0;
+
+public:
+	static constexpr size_t slotSize = SlotSize;
+
+private:
+	void grow()
+	{
+		slot* slab = new slot[SlotsPerSlab];
+		slabs.push_back(slab);
+		//Pushed in reverse so the slab is handed out front to back
+		for (int i = SlotsPerSlab - 1; i >= 0; i--)
+		{
+			slab[i].next = freeList;
+			freeList = &slab[i];
+		}
+	}
+
+public:
+	~slabPool()
+	{
+		for (int i = 0; i < slabs.size(); i++)
+			delete[] slabs[i];
+	}
+
+	void* acquire()
+	{
+		if (!freeList)
+			grow();
+		slot* taken = freeList;
+		freeList = taken->next;
+		live++;
+		return taken;
+	}
+
+	void release(void* memory)
+	{
+		slot* freed = (slot*)memory;
+		freed->next = freeList;
+		freeList = freed;
+		live--;
+	}
+
+	int liveCount()
+	{
+		return live;
+	}
+
+	int capacity()
+	{
+		return slabs.size() * SlotsPerSlab;
+	}
 };
 
 class physicsCircle : public physicsSimulation::physicsBody
@@ -57,198 +465,2953 @@ class physicsCircle : public physicsSimulation::physicsBody
 public:
 	float radius = 15;
 	float coefficientOfFriction = 0.5f;
+
+	//new and delete go through circlePool rather than the general heap. Classes derived from this one don't
+	//fit its slots and are passed on to the global operators.
+	static void* operator new(size_t size);
+	static void operator delete(void* memory, size_t size);
 	
 	physicsCircle(Vector2 conPosition, Vector2 conVelocity, float conRadius, float conCoefficientOfFriction, int conMass, Color conColor)
+		: physicsBody(CIRCLE, physicsSimulationObject.bodies)
+	{
+		position() = conPosition;
+		velocity() = conVelocity;
+		radius = conRadius;
+		coefficientOfFriction = conCoefficientOfFriction;
+		setMass(conMass);
+		color = conColor;
+	}
+	void draw() override
+	{
+		if (sensor)
+		{
+			DrawCircleLines(position().x, position().y, radius, color);
+			return;
+		}
+		DrawCircle(position().x, position().y, radius, color);
+		DrawLineEx(position(), position() + velocity(), 1, RED);
+	}
+};
+
+slabPool<sizeof(physicsCircle), alignof(physicsCircle)> circlePool;
+
+static_assert(sizeof(physicsCircle) <= decltype(circlePool)::slotSize, "physicsCircle must fit a circlePool slot");
+
+void* physicsCircle::operator new(size_t size)
+{
+	if (size != sizeof(physicsCircle))
+		return ::operator new(size);
+	return circlePool.acquire();
+}
+
+void physicsCircle::operator delete(void* memory, size_t size)
+{
+	if (size != sizeof(physicsCircle))
+	{
+		::operator delete(memory);
+		return;
+	}
+	circlePool.release(memory);
+}
+
+class physicsHalfspace : public physicsSimulation::physicsBody
+{
+private:
+	float rotation = 0;
+	Vector2 normal = { 0, -1 };
+public:
+	physicsHalfspace()
+		: physicsBody(HALFSPACE, physicsSimulationObject.bodies)
+	{
+	}
+
+	void setRotation(float rotationInDegrees)
+	{
+		rotation = rotationInDegrees;
+		normal = Vector2Rotate({ 0, -1 }, rotation * DEG2RAD);
+	}
+
+	float getRotation()
+	{
+		return rotation;
+	}
+	Vector2 getNormal()
+	{
+		return normal;
+	}
+	void draw() override
+	{
+		DrawCircle(position().x, position().y, 8, color);
+		DrawLineEx(position(), position() + normal * 30, 1, color);
+
+		Vector2 parallelToSurface = Vector2Rotate(normal, 90 * DEG2RAD);
+		DrawLineEx(position() - parallelToSurface * 4000, position() + parallelToSurface * 4000, 1, color);
+	}
+};
+
+physicsHalfspace halfspace;
+physicsSimulation::bodyHandle triggerZone;
+int triggerCount = 0;
+physicsSimulation::bodyHandle pickedBody; //Dragged with the left mouse button
+//physicsHalfspace halfspace2;
+
+std::vector<physicsSimulation::physicsBody*> pObjects;
+unsigned int nextBodyId = 1;
+
+bool shouldCollide(physicsSimulation::physicsBody* bodyA, physicsSimulation::physicsBody* bodyB)
+{
+	return (bodyA->collisionCategory & bodyB->collisionMask) && (bodyB->collisionCategory & bodyA->collisionMask);
+}
+
+//Key for an unordered pair of bodies, lower id in the high half
+unsigned long long pairKey(physicsSimulation::physicsBody* bodyA, physicsSimulation::physicsBody* bodyB)
+{
+	unsigned long long low = bodyA->id < bodyB->id ? bodyA->id : bodyB->id;
+	unsigned long long high = bodyA->id < bodyB->id ? bodyB->id : bodyA->id;
+	return (low << 32) | high;
+}
+
+struct contact
+{
+	physicsSimulation::physicsBody* a;
+	physicsSimulation::physicsBody* b;
+	Vector2 normal; //Points from a to b
+	float friction;
+	float normalMass; //1 / (invMassA + invMassB)
+	float separation; //Gap the bodies may still close this step, 0 for touching contacts
+	float normalImpulse;
+	float tangentImpulse;
+	unsigned long long key;
+};
+
+std::vector<contact> contacts;
+
+//Flat open-addressing (linear probing) map from pair key to a value. Two tables are kept, last step's and
+//this step's, so callers can tell which pairs are new, which persisted and which went away.
+template <typename T>
+class pairMap
+{
+public:
+	struct entry
+	{
+		unsigned long long key = 0; //0 marks an empty slot
+		T value;
+	};
+	std::vector<entry> previous;
+	std::vector<entry> current;
+	int currentCount = 0;
+
+	unsigned int hashKey(unsigned long long key)
+	{
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		return (unsigned int)key;
+	}
+
+	entry* find(std::vector<entry>& table, unsigned long long key)
+	{
+		if (table.empty())
+			return nullptr;
+		unsigned int mask = table.size() - 1;
+		for (unsigned int i = hashKey(key) & mask; ; i = (i + 1) & mask)
+		{
+			if (table[i].key == key)
+				return &table[i];
+			if (table[i].key == 0)
+				return nullptr;
+		}
+	}
+
+	//Returns this step's slot for key, adding one holding a default T if it isn't there yet
+	entry* insert(unsigned long long key)
+	{
+		//Stay under half full so probe chains are short and always end at an empty slot
+		if ((currentCount + 1) * 2 > current.size())
+			grow();
+		unsigned int mask = current.size() - 1;
+		unsigned int i = hashKey(key) & mask;
+		while (current[i].key != 0 && current[i].key != key)
+			i = (i + 1) & mask;
+		if (current[i].key == 0)
+		{
+			current[i].key = key;
+			currentCount++;
+		}
+		return &current[i];
+	}
+
+	void grow()
+	{
+		std::vector<entry> old;
+		old.swap(current);
+		current.assign(old.empty() ? 64 : old.size() * 2, entry());
+		unsigned int mask = current.size() - 1;
+		for (int i = 0; i < old.size(); i++)
+		{
+			if (old[i].key == 0)
+				continue;
+			unsigned int j = hashKey(old[i].key) & mask;
+			while (current[j].key != 0)
+				j = (j + 1) & mask;
+			current[j] = old[i];
+		}
+	}
+
+	//This step's table becomes previous, the new one starts at the same size
+	void beginStep()
+	{
+		previous.swap(current);
+		current.assign(previous.empty() ? 64 : previous.size(), entry());
+		currentCount = 0;
+	}
+};
+
+//Accumulated impulses of a contact, read back next step for warm starting
+struct cachedContact
+{
+	float normalImpulse = 0;
+	float tangentImpulse = 0;
+	int contactIndex = -1; //Into contacts for this step, also dedupes pairs reported twice
+};
+
+pairMap<cachedContact> contactCacheObject;
+
+float inverseMass(physicsSimulation::physicsBody* body)
+{
+	return body->inverseMass();
+}
+
+//Records a touching (or with separation > 0, a speculative) pair for the velocity solver. Pairs reported
+//twice in a step (the brute force loop visits both orders) share one contact.
+void addContact(physicsSimulation::physicsBody* bodyA, physicsSimulation::physicsBody* bodyB, Vector2 normalAtoB, float friction, float separation = 0)
+{
+	unsigned long long key = pairKey(bodyA, bodyB);
+	//The solver is about to change both velocities, any time-to-contact estimate involving them is void
+	bodyA->disturbedStep = physicsSimulationObject.stepCount;
+	bodyB->disturbedStep = physicsSimulationObject.stepCount;
+	pairMap<cachedContact>::entry* slot = contactCacheObject.insert(key);
+	if (slot->value.contactIndex != -1)
+		return;
+	slot->value.contactIndex = contacts.size();
+
+	float invMassSum = inverseMass(bodyA) + inverseMass(bodyB);
+	contact newContact;
+	newContact.a = bodyA;
+	newContact.b = bodyB;
+	newContact.normal = normalAtoB;
+	newContact.friction = friction;
+	newContact.normalMass = invMassSum > 0 ? 1 / invMassSum : 0;
+	newContact.separation = separation;
+	newContact.normalImpulse = 0;
+	newContact.tangentImpulse = 0;
+	newContact.key = key;
+	contacts.push_back(newContact);
+}
+
+//bool circleCircleCollision(physicsCircle* circleA, physicsCircle* circleB)
+//{
+//	float sumRadii = circleA->radius + circleB->radius;
+//	Vector2 displacement = circleB->position - circleA->position;
+//
+//	float distance = Vector2Length(displacement);
+//
+//	return (distance < sumRadii) ? true : false;
+//}
+
+void circleCircleContactResponse(physicsCircle* circleA, physicsCircle* circleB, Vector2 normalAtoB, float overlap)
+{
+	Vector2 mtv = normalAtoB * overlap; // Minimum translation vector (to push apart for collision)
+	circleA->position() -= mtv * 0.5f;
+	circleB->position() += mtv * 0.5f;
+	addContact(circleA, circleB, normalAtoB, sqrtf(circleA->coefficientOfFriction * circleB->coefficientOfFriction));
+}
+
+bool circleCircleCollisionResponse(physicsCircle* circleA, physicsCircle* circleB)
+{
+	float sumRadii = circleA->radius + circleB->radius;
+	Vector2 displacement = circleB->position() - circleA->position();
+
+	float distance = Vector2Length(displacement);
+	float overlap = sumRadii - distance;
+
+	if (overlap > 0)
+	{
+		Vector2 normalAtoB;
+		if (!distance)
+			normalAtoB = { 0, 1 };
+		else
+			normalAtoB = displacement / distance;
+		circleCircleContactResponse(circleA, circleB, normalAtoB, overlap);
+		return true;
+	}
+	else
+	{
+		//Separated but closing fast enough to meet within the step: let the solver limit the approach to the gap
+		if (physicsSimulationObject.continuousCollision == CCD_SPECULATIVE && distance > 0)
+		{
+			Vector2 normalAtoB = displacement / distance;
+			float closing = Vector2DotProduct(circleA->velocity() - circleB->velocity(), normalAtoB) * physicsSimulationObject.deltaTime;
+			if (closing > -overlap)
+			{
+				addContact(circleA, circleB, normalAtoB, sqrtf(circleA->coefficientOfFriction * circleB->coefficientOfFriction), -overlap);
+				physicsSimulationObject.speculativeContacts++;
+			}
+		}
+		return false;
+	}
+}
+
+//bool circleHalfspaceCollision(physicsCircle* circle, physicsHalfspace* halfspace)
+//{
+//	Vector2 displacementToCircle = circle->position - halfspace->position;
+//
+//	float dotProduct = Vector2DotProduct(displacementToCircle, halfspace->getNormal());
+//	Vector2 vectorProjection = halfspace->getNormal() * dotProduct;
+//	//float distance = Vector2Length(displacementToCircle);
+//
+//	DrawLineEx(circle->position, circle->position - vectorProjection, 1, GRAY);
+//
+//	Vector2 midpoint = circle->position - vectorProjection * 0.5f;
+//	DrawText(TextFormat("D: %3.0f", dotProduct), midpoint.x, midpoint.y, 30, LIGHTGRAY);
+//
+//	return dotProduct < circle->radius;
+//}
+
+//Pushes a circle out of a plane by overlap along normal and applies the normal and friction forces
+void halfspaceContactResponse(physicsCircle* circle, physicsHalfspace* halfspace, Vector2 normal, float overlap)
+{
+	Vector2 mtv = normal * overlap;
+	circle->position() += mtv;
+	Vector2 Fgravity = physicsSimulationObject.gravAccel * circle->getMass();
+
+	Vector2 FgPerp = normal * Vector2DotProduct(Fgravity, normal);
+	Vector2 Fnormal = FgPerp * -1;
+	circle->netForce() += Fnormal;
+	DrawLineEx(circle->position(), circle->position() + Fnormal, 1, GREEN);
+
+	float u = circle->coefficientOfFriction;
+	float frictionMagnitude = u * Vector2Length(Fnormal);
+
+	Vector2 FgPara = Fgravity - FgPerp;
+	Vector2 frictionDir = Vector2Normalize(FgPara) * -1;
+
+	Vector2 Ffriction = frictionDir * frictionMagnitude;
+
+	circle->netForce() += Ffriction;
+	DrawLineEx(circle->position(), circle->position() + Ffriction, 1, ORANGE);
+
+	addContact(circle, halfspace, normal * -1, circle->coefficientOfFriction);
+}
+
+struct bodyPair
+{
+	physicsSimulation::physicsBody* a;
+	physicsSimulation::physicsBody* b;
+};
+
+//Compile-time shape dispatch. Adding a shape takes a shapeClass specialization, a collide() specialization
+//for each shape it should hit, and one registerPair() line per combination in registerShapePairs().
+template<int Shape> struct shapeClass;
+template<> struct shapeClass<CIRCLE> { typedef physicsCircle type; };
+template<> struct shapeClass<HALFSPACE> { typedef physicsHalfspace type; };
+
+//Narrowphase and response for one shape combination, returns whether they overlapped
+template<typename ShapeA, typename ShapeB> bool collide(ShapeA* a, ShapeB* b);
+
+template<> bool collide<physicsCircle, physicsCircle>(physicsCircle* a, physicsCircle* b)
+{
+	return circleCircleCollisionResponse(a, b);
+}
+
+//Checked as each bucketed pair is reached rather than when the buckets are filled, so a body pushed by an
+//earlier pair this step is already marked disturbed
+template<typename ShapeA, typename ShapeB> bool skipPair(ShapeA* a, ShapeB* b)
+{
+	return false;
+}
+
+bool skipScheduledPair(physicsCircle* circleA, physicsCircle* circleB); //Comes with the pair schedule
+
+template<> bool skipPair<physicsCircle, physicsCircle>(physicsCircle* a, physicsCircle* b)
+{
+	return physicsSimulationObject.pairScheduling && skipScheduledPair(a, b);
+}
+
+typedef bool (*pairFunction)(physicsSimulation::physicsBody*, physicsSimulation::physicsBody*);
+typedef int (*bucketFunction)(std::vector<bodyPair>&);
+
+//Indexed by both shapes in either order, nullptr for combinations that never collide
+pairFunction collideTable[SHAPE_COUNT][SHAPE_COUNT] = {};
+//Indexed lower shape first, runs a whole bucket of pairs whose a has shape A and b has shape B
+bucketFunction bucketTable[SHAPE_COUNT][SHAPE_COUNT] = {};
+
+template<int A, int B, bool Swapped>
+bool collidePair(physicsSimulation::physicsBody* objectA, physicsSimulation::physicsBody* objectB)
+{
+	typedef typename shapeClass<A>::type classA;
+	typedef typename shapeClass<B>::type classB;
+	if constexpr (Swapped)
+		return collide(static_cast<classA*>(objectB), static_cast<classB*>(objectA));
+	else
+		return collide(static_cast<classA*>(objectA), static_cast<classB*>(objectB));
+}
+
+//One monomorphic loop per combination, the collide() call is resolved at compile time and can be inlined
+template<int A, int B>
+int collideBucket(std::vector<bodyPair>& pairs)
+{
+	typedef typename shapeClass<A>::type classA;
+	typedef typename shapeClass<B>::type classB;
+	int overlaps = 0;
+	for (int i = 0; i < pairs.size(); i++)
+	{
+		classA* a = static_cast<classA*>(pairs[i].a);
+		classB* b = static_cast<classB*>(pairs[i].b);
+		if (skipPair(a, b))
+		{
+			physicsSimulationObject.pairsSkipped++;
+			continue;
+		}
+		overlaps += collide(a, b);
+	}
+	return overlaps;
+}
+
+template<int A, int B>
+void registerPair()
+{
+	static_assert(A <= B, "register a combination with the lower shape first");
+	collideTable[A][B] = collidePair<A, B, false>;
+	collideTable[B][A] = collidePair<A, B, true>;
+	bucketTable[A][B] = collideBucket<A, B>;
+}
+
+bool registerShapePairs()
+{
+	//Circle-halfspace is left out on purpose, planes never reach the pair loops and go through planeCollision()
+	registerPair<CIRCLE, CIRCLE>();
+	return true;
+}
+
+bool shapePairsRegistered = registerShapePairs();
+
+//Dispatches a single pair through the table, for loops that don't bucket
+bool collisionResponse(physicsSimulation::physicsBody* objectA, physicsSimulation::physicsBody* objectB)
+{
+	pairFunction function = collideTable[objectA->Shape()][objectB->Shape()];
+	return function && function(objectA, objectB);
+}
+
+//Pairs waiting for the narrowphase, grouped lower shape first so each group runs through collideBucket()
+std::vector<bodyPair> pairBuckets[SHAPE_COUNT][SHAPE_COUNT];
+
+std::vector<bodyPair> candidatePairs;
+
+//Persistent threads for data-parallel loops. The calling thread works through the jobs as well, so on a
+//single core machine everything simply runs inline.
+class workerPool
+{
+public:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable finished;
+	void (*invoke)(void* job, int index) = nullptr; //Calls the current job through a type-erased pointer, no allocation
+	void* job = nullptr;
+	int jobCount = 0;
+	std::atomic<int> nextJob{ 0 };
+	int busy = 0; //Workers that haven't finished the current batch yet
+	unsigned int generation = 0; //Bumped per parallelFor() so workers can tell a new batch from a spurious wakeup
+	bool stopping = false;
+	bool started = false;
+
+	void start(int count)
+	{
+		started = true;
+		for (int i = 0; i < count; i++)
+			threads.emplace_back([this]() { workerLoop(); });
+	}
+
+	~workerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (int i = 0; i < threads.size(); i++)
+			threads[i].join();
+	}
+
+	//Calls fn(0) .. fn(count - 1) spread over the workers and returns once all of them are done
+	template<typename Function>
+	void parallelFor(int count, Function&& fn)
+	{
+		if (threads.empty())
+		{
+			for (int i = 0; i < count; i++)
+				fn(i);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &fn;
+			invoke = [](void* target, int index) { (*(std::remove_reference_t<Function>*)target)(index); };
+			jobCount = count;
+			nextJob = 0;
+			busy = threads.size();
+			generation++;
+		}
+		wake.notify_all();
+		runJobs();
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [this]() { return busy == 0; });
+		job = nullptr;
+	}
+
+	void runJobs()
+	{
+		for (int i = nextJob++; i < jobCount; i = nextJob++)
+			invoke(job, i);
+	}
+
+	void workerLoop()
+	{
+		unsigned int seen = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&]() { return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+			}
+			runJobs();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--busy == 0)
+				finished.notify_one();
+		}
+	}
+};
+
+workerPool workers;
+std::vector<std::vector<bodyPair>> chunkPairs;
+std::vector<int> chunkOffsets;
+
+//Splits [0, count) into contiguous chunks, has findChunk(pairs, first, last) fill one buffer per chunk on the
+//worker pool, then appends the buffers to out in chunk order. Each chunk emits its pairs in the same order a
+//single pass over its range would, so the result matches the serial run exactly however the chunks were scheduled.
+void parallelPairs(int count, void (*findChunk)(std::vector<bodyPair>&, int, int), std::vector<bodyPair>& out)
+{
+	const int minChunk = 512; //Below this the wakeup costs more than the work
+	if (!workers.started)
+		workers.start(std::max(0, (int)std::thread::hardware_concurrency() - 1));
+	int chunks = std::min(count / minChunk, 4 * ((int)workers.threads.size() + 1));
+	if (!physicsSimulationObject.parallelBroadphase || chunks < 2)
+	{
+		findChunk(out, 0, count);
+		return;
+	}
+
+	if (chunkPairs.size() < chunks)
+		chunkPairs.resize(chunks);
+	workers.parallelFor(chunks, [&](int chunk) {
+		chunkPairs[chunk].clear();
+		findChunk(chunkPairs[chunk], (long long)count * chunk / chunks, (long long)count * (chunk + 1) / chunks);
+	});
+
+	//Prefix sum of the buffer sizes gives every chunk its slot, the copies are independent
+	chunkOffsets.resize(chunks + 1);
+	chunkOffsets[0] = out.size();
+	for (int chunk = 0; chunk < chunks; chunk++)
+		chunkOffsets[chunk + 1] = chunkOffsets[chunk] + chunkPairs[chunk].size();
+	out.resize(chunkOffsets[chunks]);
+	workers.parallelFor(chunks, [&](int chunk) {
+		std::copy(chunkPairs[chunk].begin(), chunkPairs[chunk].end(), out.begin() + chunkOffsets[chunk]);
+	});
+}
+
+//How far a circle can travel this step. Broadphases widen their bounds by it when speculative contacts
+//are on, since those need pairs that aren't touching yet.
+float speculativeReach(physicsCircle* circle)
+{
+	if (physicsSimulationObject.continuousCollision != CCD_SPECULATIVE)
+		return 0;
+	return Vector2Length(circle->velocity()) * physicsSimulationObject.deltaTime;
+}
+
+//Uniform grid hashed into a fixed table. Each circle lives in the cell holding its centre and cells are
+//2x the largest radius wide, so any touching pair is always in the same or an adjacent cell.
+class spatialHashGrid
+{
+public:
+	float cellSize = 30;
+	unsigned int tableSize = 0;
+	std::vector<physicsCircle*> circles;
+	std::vector<int> cellX;
+	std::vector<int> cellY;
+	std::vector<unsigned int> bucket;
+	std::vector<int> bucketStart; //tableSize + 1 entries, bodies of bucket b are sorted[bucketStart[b]..bucketStart[b+1])
+	std::vector<int> sorted;
+
+	unsigned int hashCell(int x, int y)
+	{
+		return ((unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u) & (tableSize - 1);
+	}
+
+	//margin widens the cells so pairs up to that far apart are still found in neighbouring cells
+	void build(std::vector<physicsSimulation::physicsBody*>& bodies, float margin = 0)
+	{
+		circles.clear();
+		float maxRadius = 0;
+		for (int i = 0; i < bodies.size(); i++)
+		{
+			//Sensors are left out so a large trigger zone doesn't set the cell size, see findSensorOverlaps()
+			if (bodies[i]->Shape() == CIRCLE && !bodies[i]->sensor)
+			{
+				physicsCircle* circle = (physicsCircle*)bodies[i];
+				circles.push_back(circle);
+				if (circle->radius > maxRadius)
+					maxRadius = circle->radius;
+			}
+		}
+		cellSize = maxRadius > 0 ? maxRadius * 2 + margin : 30;
+
+		//Power of two with at least two buckets per circle keeps chains short
+		tableSize = 64;
+		while (tableSize < circles.size() * 2)
+			tableSize *= 2;
+
+		int count = circles.size();
+		cellX.resize(count);
+		cellY.resize(count);
+		bucket.resize(count);
+		sorted.resize(count);
+		bucketStart.assign(tableSize + 1, 0);
+
+		for (int i = 0; i < count; i++)
+		{
+			cellX[i] = (int)floorf(circles[i]->position().x / cellSize);
+			cellY[i] = (int)floorf(circles[i]->position().y / cellSize);
+			bucket[i] = hashCell(cellX[i], cellY[i]);
+			bucketStart[bucket[i] + 1]++;
+		}
+		for (unsigned int b = 0; b < tableSize; b++)
+			bucketStart[b + 1] += bucketStart[b];
+
+		//Counting sort, bucketStart is used as the write cursor and restored afterwards
+		for (int i = 0; i < count; i++)
+			sorted[bucketStart[bucket[i]]++] = i;
+		for (unsigned int b = tableSize; b > 0; b--)
+			bucketStart[b] = bucketStart[b - 1];
+		bucketStart[0] = 0;
+	}
+
+	//Emits every circle pair in neighbouring cells exactly once (lower index first), for circles [first, last).
+	//Only reads the grid, so disjoint ranges can run on different threads.
+	void findPairs(std::vector<bodyPair>& pairs, int first, int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			unsigned int visited[9];
+			int visitedCount = 0;
+			for (int dy = -1; dy <= 1; dy++)
+			{
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					unsigned int b = hashCell(cellX[i] + dx, cellY[i] + dy);
+
+					//Two neighbouring cells can hash to the same bucket, only walk it once
+					bool seen = false;
+					for (int v = 0; v < visitedCount; v++)
+						seen = seen || visited[v] == b;
+					if (seen)
+						continue;
+					visited[visitedCount++] = b;
+
+					for (int k = bucketStart[b]; k < bucketStart[b + 1]; k++)
+					{
+						int j = sorted[k];
+						if (j <= i
+							|| abs(cellX[j] - cellX[i]) > 1
+							|| abs(cellY[j] - cellY[i]) > 1)
+							continue;
+						pairs.push_back({ circles[i], circles[j] });
+					}
+				}
+			}
+		}
+	}
+};
+
+spatialHashGrid grid;
+
+void findGridPairs(std::vector<bodyPair>& out)
+{
+	parallelPairs(grid.circles.size(), [](std::vector<bodyPair>& pairs, int first, int last) { grid.findPairs(pairs, first, last); }, out);
+}
+
+//Sort-and-sweep on the x axis. The endpoint list persists between steps and is repaired with an
+//insertion sort, which is close to O(n) when bodies barely move from one frame to the next.
+class sweepAndPrune
+{
+public:
+	struct endpoint
+	{
+		float value;
+		physicsCircle* circle;
+		bool isMin;
+	};
+	std::vector<endpoint> endpoints;
+	std::vector<physicsCircle*> active;
+
+	void insert(physicsCircle* circle)
+	{
+		endpoints.push_back({ circle->position().x - circle->radius, circle, true });
+		endpoints.push_back({ circle->position().x + circle->radius, circle, false });
+	}
+
+	//Drops the endpoints of every body marked by removeBody() in a single pass, keeping the rest sorted
+	void removeMarked()
+	{
+		int write = 0;
+		for (int i = 0; i < endpoints.size(); i++)
+		{
+			if (!endpoints[i].circle->pendingRemoval)
+				endpoints[write++] = endpoints[i];
+		}
+		endpoints.resize(write);
+	}
+
+	void update()
+	{
+		for (int i = 0; i < endpoints.size(); i++)
+		{
+			physicsCircle* circle = endpoints[i].circle;
+			float extent = circle->radius + speculativeReach(circle);
+			endpoints[i].value = endpoints[i].isMin ? circle->position().x - extent : circle->position().x + extent;
+		}
+
+		for (int i = 1; i < endpoints.size(); i++)
+		{
+			endpoint key = endpoints[i];
+			int j = i - 1;
+			//Mins sort before maxes at equal values so touching intervals still count as overlapping
+			while (j >= 0 && (endpoints[j].value > key.value
+				|| (endpoints[j].value == key.value && key.isMin && !endpoints[j].isMin)))
+			{
+				endpoints[j + 1] = endpoints[j];
+				j--;
+			}
+			endpoints[j + 1] = key;
+		}
+	}
+
+	void findPairs(std::vector<bodyPair>& pairs)
+	{
+		active.clear();
+		for (int i = 0; i < endpoints.size(); i++)
+		{
+			physicsCircle* circle = endpoints[i].circle;
+			if (endpoints[i].isMin)
+			{
+				for (int j = 0; j < active.size(); j++)
+				{
+					physicsCircle* other = active[j];
+					float extent = other->radius + circle->radius + speculativeReach(other) + speculativeReach(circle);
+					if (fabsf(other->position().y - circle->position().y) <= extent)
+						pairs.push_back({ other, circle });
+				}
+				active.push_back(circle);
+			}
+			else
+			{
+				for (int j = 0; j < active.size(); j++)
+				{
+					if (active[j] == circle)
+					{
+						active[j] = active.back();
+						active.pop_back();
+						break;
+					}
+				}
+			}
+		}
+	}
+};
+
+sweepAndPrune sap;
+
+struct aabb
+{
+	Vector2 min;
+	Vector2 max;
+};
+
+aabb aabbUnion(aabb a, aabb b)
+{
+	return { Vector2Min(a.min, b.min), Vector2Max(a.max, b.max) };
+}
+
+bool aabbOverlap(aabb a, aabb b)
+{
+	return a.min.x <= b.max.x && b.min.x <= a.max.x
+		&& a.min.y <= b.max.y && b.min.y <= a.max.y;
+}
+
+bool aabbContains(aabb outer, aabb inner)
+{
+	return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y
+		&& inner.max.x <= outer.max.x && inner.max.y <= outer.max.y;
+}
+
+//Perimeter stands in for surface area in 2D when comparing insertion costs
+float aabbPerimeter(aabb box)
+{
+	return 2 * ((box.max.x - box.min.x) + (box.max.y - box.min.y));
+}
+
+aabb circleBounds(physicsCircle* circle)
+{
+	Vector2 extent = { circle->radius, circle->radius };
+	return { circle->position() - extent, circle->position() + extent };
+}
+
+//Box covering a circle over a whole step of motion
+aabb sweptCircleBounds(physicsCircle* circle, Vector2 motion)
+{
+	aabb box = circleBounds(circle);
+	return aabbUnion(box, { box.min + motion, box.max + motion });
+}
+
+//Dynamic bounding volume tree. Leaves hold a fattened box so a body only needs to be reinserted once it
+//leaves it, which suits mixed sizes much better than a grid with one cell size.
+class aabbTree
+{
+public:
+	struct node
+	{
+		aabb box;
+		physicsCircle* circle = nullptr; //Only set on leaves
+		int parent = -1;
+		int child1 = -1;
+		int child2 = -1;
+		int height = -1; //0 for leaves, -1 for nodes on the free list
+		bool refitted = false; //Leaf was grown in place rather than reinserted, queued for a better placement
+	};
+	//A leaf as handed to a background rebuild, see treeRebuildJob
+	struct leafSnapshot
+	{
+		aabb box;
+		physicsCircle* circle; //Only stored, never dereferenced off the main thread
+		unsigned int id;
+		int leaf;
+	};
+	std::vector<node> nodes;
+	int root = -1;
+	int freeList = -1; //Free nodes are chained through parent
+	float fatMargin = 4;
+	float displacementMultiplier = 2; //How many steps of motion the fat box is stretched by
+	int syncedStep = -1; //stepCount the leaves were last checked against, see syncTree()
+	bool refitLeaves = true; //Grow escaped leaves in place instead of reinserting them
+	std::vector<int> refitQueue;
+
+	int allocateNode()
+	{
+		if (freeList == -1)
+		{
+			nodes.push_back(node());
+			freeList = nodes.size() - 1;
+		}
+		int index = freeList;
+		freeList = nodes[index].parent;
+		nodes[index] = node();
+		nodes[index].height = 0;
+		return index;
+	}
+
+	void freeNode(int index)
+	{
+		nodes[index].parent = freeList;
+		nodes[index].height = -1;
+		nodes[index].circle = nullptr;
+		freeList = index;
+	}
+
+	aabb fatBounds(physicsCircle* circle, Vector2 displacement)
+	{
+		aabb box = circleBounds(circle);
+		Vector2 margin = { fatMargin, fatMargin };
+		box.min -= margin;
+		box.max += margin;
+		Vector2 d = displacement * displacementMultiplier;
+		if (d.x < 0) box.min.x += d.x; else box.max.x += d.x;
+		if (d.y < 0) box.min.y += d.y; else box.max.y += d.y;
+		return box;
+	}
+
+	int insert(physicsCircle* circle)
+	{
+		int leaf = allocateNode();
+		nodes[leaf].box = fatBounds(circle, { 0, 0 });
+		nodes[leaf].circle = circle;
+		insertLeaf(leaf);
+		return leaf;
+	}
+
+	void remove(int leaf)
+	{
+		removeLeaf(leaf);
+		freeNode(leaf);
+	}
+
+	//Returns true when the body left its fat box and had to be reinserted. Speculative contacts also need
+	//the box to cover where the body is heading this step.
+	bool move(int leaf, Vector2 displacement)
+	{
+		physicsCircle* circle = nodes[leaf].circle;
+		aabb required = circleBounds(circle);
+		if (physicsSimulationObject.continuousCollision == CCD_SPECULATIVE)
+			required = sweptCircleBounds(circle, displacement);
+		if (aabbContains(nodes[leaf].box, required))
+			return false;
+
+		if (refitLeaves)
+		{
+			refit(leaf, fatBounds(circle, displacement));
+			if (!nodes[leaf].refitted)
+			{
+				nodes[leaf].refitted = true;
+				refitQueue.push_back(leaf);
+			}
+			return true;
+		}
+		removeLeaf(leaf);
+		nodes[leaf].box = fatBounds(circle, displacement);
+		insertLeaf(leaf);
+		return true;
+	}
+
+	//Gives the leaf a new box and grows its ancestors to match, leaving the hierarchy alone. Much cheaper than
+	//reinsertion but the leaf can end up far from its siblings, so the tree gets looser over time, see cost().
+	void refit(int leaf, aabb box)
+	{
+		nodes[leaf].box = box;
+		for (int index = nodes[leaf].parent; index != -1; index = nodes[index].parent)
+		{
+			aabb combined = aabbUnion(nodes[nodes[index].child1].box, nodes[nodes[index].child2].box);
+			if (aabbContains(nodes[index].box, combined))
+				break;
+			nodes[index].box = combined;
+		}
+	}
+
+	//Moves up to budget queued leaves to the place insertLeaf() would pick for them now
+	int reinsertRefitted(int budget)
+	{
+		int done = 0;
+		while (done < budget && !refitQueue.empty())
+		{
+			int leaf = refitQueue.back();
+			refitQueue.pop_back();
+			//Entries can be stale if the leaf was removed since, allocateNode() clears the flag on reuse
+			if (nodes[leaf].height != 0 || !nodes[leaf].refitted)
+				continue;
+			nodes[leaf].refitted = false;
+			removeLeaf(leaf);
+			insertLeaf(leaf);
+			done++;
+		}
+		return done;
+	}
+
+	//Surface area heuristic in 2D: summed perimeter of the internal nodes, which is what a query pays to
+	//descend, relative to the summed perimeter of the leaves so it doesn't change with body count
+	float cost()
+	{
+		float internal = 0;
+		float leaves = 0;
+		for (int i = 0; i < nodes.size(); i++)
+		{
+			if (nodes[i].height > 0)
+				internal += aabbPerimeter(nodes[i].box);
+			else if (nodes[i].height == 0)
+				leaves += aabbPerimeter(nodes[i].box);
+		}
+		return leaves > 0 ? internal / leaves : 0;
+	}
+
+	int leafCount()
+	{
+		int count = 0;
+		for (int i = 0; i < nodes.size(); i++)
+		{
+			if (nodes[i].height == 0)
+				count++;
+		}
+		return count;
+	}
+
+	//Top-down build replacing the whole tree. leafOf[i] receives the node created for leaves[i].
+	void build(const std::vector<leafSnapshot>& leaves, std::vector<int>& leafOf)
+	{
+		nodes.clear();
+		refitQueue.clear();
+		freeList = -1;
+		root = -1;
+		leafOf.assign(leaves.size(), -1);
+		if (leaves.empty())
+			return;
+		std::vector<int> order(leaves.size());
+		for (int i = 0; i < order.size(); i++)
+			order[i] = i;
+		std::vector<float> splitCost(leaves.size());
+		root = buildRange(leaves, order, splitCost, 0, leaves.size(), leafOf);
+		nodes[root].parent = -1;
+	}
+
+	//Sorts leaves [first, last) along the longer axis of their centres and splits where perimeter times leaf
+	//count summed over both halves is lowest. Ties keep the median split so identical boxes can't make a chain.
+	int buildRange(const std::vector<leafSnapshot>& leaves, std::vector<int>& order, std::vector<float>& splitCost, int first, int last, std::vector<int>& leafOf)
+	{
+		if (last - first == 1)
+		{
+			int leaf = allocateNode();
+			nodes[leaf].box = leaves[order[first]].box;
+			nodes[leaf].circle = leaves[order[first]].circle;
+			leafOf[order[first]] = leaf;
+			return leaf;
+		}
+
+		Vector2 low = { INFINITY, INFINITY };
+		Vector2 high = { -INFINITY, -INFINITY };
+		for (int k = first; k < last; k++)
+		{
+			Vector2 centre = (leaves[order[k]].box.min + leaves[order[k]].box.max) * 0.5f;
+			low = Vector2Min(low, centre);
+			high = Vector2Max(high, centre);
+		}
+		bool splitX = high.x - low.x >= high.y - low.y;
+		std::sort(order.begin() + first, order.begin() + last, [&](int a, int b) {
+			const aabb& boxA = leaves[a].box;
+			const aabb& boxB = leaves[b].box;
+			return splitX ? boxA.min.x + boxA.max.x < boxB.min.x + boxB.max.x : boxA.min.y + boxA.max.y < boxB.min.y + boxB.max.y;
+		});
+
+		//splitCost[k] is the cost of putting [first, k) and [k, last) in separate children
+		aabb box = leaves[order[last - 1]].box;
+		for (int k = last - 1; k > first; k--)
+		{
+			box = aabbUnion(box, leaves[order[k]].box);
+			splitCost[k] = aabbPerimeter(box) * (last - k);
+		}
+		box = leaves[order[first]].box;
+		for (int k = first + 1; k < last; k++)
+		{
+			splitCost[k] += aabbPerimeter(box) * (k - first);
+			box = aabbUnion(box, leaves[order[k]].box);
+		}
+		int split = (first + last) / 2;
+		for (int k = first + 1; k < last; k++)
+		{
+			if (splitCost[k] < splitCost[split])
+				split = k;
+		}
+
+		int index = allocateNode();
+		int child1 = buildRange(leaves, order, splitCost, first, split, leafOf);
+		int child2 = buildRange(leaves, order, splitCost, split, last, leafOf);
+		nodes[index].child1 = child1;
+		nodes[index].child2 = child2;
+		nodes[child1].parent = index;
+		nodes[child2].parent = index;
+		nodes[index].box = aabbUnion(nodes[child1].box, nodes[child2].box);
+		nodes[index].height = 1 + std::max(nodes[child1].height, nodes[child2].height);
+		return index;
+	}
+
+	void insertLeaf(int leaf)
+	{
+		if (root == -1)
+		{
+			root = leaf;
+			nodes[root].parent = -1;
+			return;
+		}
+
+		//Walk down picking the child that grows the least until stopping here is cheaper
+		aabb leafBox = nodes[leaf].box;
+		int index = root;
+		while (nodes[index].child1 != -1)
+		{
+			int child1 = nodes[index].child1;
+			int child2 = nodes[index].child2;
+
+			float area = aabbPerimeter(nodes[index].box);
+			float combinedArea = aabbPerimeter(aabbUnion(nodes[index].box, leafBox));
+			float cost = 2 * combinedArea;
+			float inheritanceCost = 2 * (combinedArea - area);
+
+			float cost1 = aabbPerimeter(aabbUnion(leafBox, nodes[child1].box)) + inheritanceCost;
+			if (nodes[child1].child1 != -1)
+				cost1 -= aabbPerimeter(nodes[child1].box);
+			float cost2 = aabbPerimeter(aabbUnion(leafBox, nodes[child2].box)) + inheritanceCost;
+			if (nodes[child2].child1 != -1)
+				cost2 -= aabbPerimeter(nodes[child2].box);
+
+			if (cost < cost1 && cost < cost2)
+				break;
+			index = cost1 < cost2 ? child1 : child2;
+		}
+
+		int sibling = index;
+		int oldParent = nodes[sibling].parent;
+		int newParent = allocateNode();
+		nodes[newParent].parent = oldParent;
+		nodes[newParent].box = aabbUnion(leafBox, nodes[sibling].box);
+		nodes[newParent].height = nodes[sibling].height + 1;
+
+		if (oldParent != -1)
+		{
+			if (nodes[oldParent].child1 == sibling)
+				nodes[oldParent].child1 = newParent;
+			else
+				nodes[oldParent].child2 = newParent;
+		}
+		else
+			root = newParent;
+
+		nodes[newParent].child1 = sibling;
+		nodes[newParent].child2 = leaf;
+		nodes[sibling].parent = newParent;
+		nodes[leaf].parent = newParent;
+
+		fixUpwards(nodes[leaf].parent);
+	}
+
+	void removeLeaf(int leaf)
+	{
+		if (leaf == root)
+		{
+			root = -1;
+			return;
+		}
+
+		int parent = nodes[leaf].parent;
+		int grandParent = nodes[parent].parent;
+		int sibling = nodes[parent].child1 == leaf ? nodes[parent].child2 : nodes[parent].child1;
+
+		if (grandParent != -1)
+		{
+			if (nodes[grandParent].child1 == parent)
+				nodes[grandParent].child1 = sibling;
+			else
+				nodes[grandParent].child2 = sibling;
+			nodes[sibling].parent = grandParent;
+			freeNode(parent);
+			fixUpwards(grandParent);
+		}
+		else
+		{
+			root = sibling;
+			nodes[sibling].parent = -1;
+			freeNode(parent);
+		}
+	}
+
+	//Rebalances and refits every ancestor from index up to the root
+	void fixUpwards(int index)
+	{
+		while (index != -1)
+		{
+			index = balance(index);
+			int child1 = nodes[index].child1;
+			int child2 = nodes[index].child2;
+			nodes[index].height = 1 + std::max(nodes[child1].height, nodes[child2].height);
+			nodes[index].box = aabbUnion(nodes[child1].box, nodes[child2].box);
+			index = nodes[index].parent;
+		}
+	}
+
+	//Performs a left or right rotation if node A is imbalanced, returns the new subtree root
+	int balance(int iA)
+	{
+		node& A = nodes[iA];
+		if (A.child1 == -1 || A.height < 2)
+			return iA;
+
+		int iB = A.child1;
+		int iC = A.child2;
+		node& B = nodes[iB];
+		node& C = nodes[iC];
+		int heightDifference = C.height - B.height;
+
+		//Rotate C up
+		if (heightDifference > 1)
+		{
+			int iF = C.child1;
+			int iG = C.child2;
+			node& F = nodes[iF];
+			node& G = nodes[iG];
+
+			C.child1 = iA;
+			C.parent = A.parent;
+			A.parent = iC;
+			if (C.parent != -1)
+			{
+				if (nodes[C.parent].child1 == iA)
+					nodes[C.parent].child1 = iC;
+				else
+					nodes[C.parent].child2 = iC;
+			}
+			else
+				root = iC;
+
+			if (F.height > G.height)
+			{
+				C.child2 = iF;
+				A.child2 = iG;
+				G.parent = iA;
+				A.box = aabbUnion(B.box, G.box);
+				C.box = aabbUnion(A.box, F.box);
+				A.height = 1 + std::max(B.height, G.height);
+				C.height = 1 + std::max(A.height, F.height);
+			}
+			else
+			{
+				C.child2 = iG;
+				A.child2 = iF;
+				F.parent = iA;
+				A.box = aabbUnion(B.box, F.box);
+				C.box = aabbUnion(A.box, G.box);
+				A.height = 1 + std::max(B.height, F.height);
+				C.height = 1 + std::max(A.height, G.height);
+			}
+			return iC;
+		}
+
+		//Rotate B up
+		if (heightDifference < -1)
+		{
+			int iD = B.child1;
+			int iE = B.child2;
+			node& D = nodes[iD];
+			node& E = nodes[iE];
+
+			B.child1 = iA;
+			B.parent = A.parent;
+			A.parent = iB;
+			if (B.parent != -1)
+			{
+				if (nodes[B.parent].child1 == iA)
+					nodes[B.parent].child1 = iB;
+				else
+					nodes[B.parent].child2 = iB;
+			}
+			else
+				root = iB;
+
+			if (D.height > E.height)
+			{
+				B.child2 = iD;
+				A.child1 = iE;
+				E.parent = iA;
+				A.box = aabbUnion(C.box, E.box);
+				B.box = aabbUnion(A.box, D.box);
+				A.height = 1 + std::max(C.height, E.height);
+				B.height = 1 + std::max(A.height, D.height);
+			}
+			else
+			{
+				B.child2 = iE;
+				A.child1 = iD;
+				D.parent = iA;
+				A.box = aabbUnion(C.box, D.box);
+				B.box = aabbUnion(A.box, E.box);
+				A.height = 1 + std::max(C.height, D.height);
+				B.height = 1 + std::max(A.height, E.height);
+			}
+			return iB;
+		}
+
+		return iA;
+	}
+
+	//Queries the tree with the fat box of every leaf among nodes [first, last), emitting each overlapping leaf
+	//pair once. Read-only apart from the caller's stack, so disjoint ranges can run on different threads.
+	void findPairs(std::vector<bodyPair>& pairs, int first, int last, std::vector<int>& stack)
+	{
+		if (root == -1)
+			return;
+		for (int leaf = first; leaf < last; leaf++)
+		{
+			if (nodes[leaf].height != 0)
+				continue;
+			aabb box = nodes[leaf].box;
+			stack.clear();
+			stack.push_back(root);
+			while (!stack.empty())
+			{
+				int index = stack.back();
+				stack.pop_back();
+				if (!aabbOverlap(nodes[index].box, box))
+					continue;
+				if (nodes[index].child1 == -1)
+				{
+					if (index > leaf)
+						pairs.push_back({ nodes[leaf].circle, nodes[index].circle });
+				}
+				else
+				{
+					stack.push_back(nodes[index].child1);
+					stack.push_back(nodes[index].child2);
+				}
+			}
+		}
+	}
+};
+
+aabbTree tree;
+
+//Rebuilds the tree from a snapshot of its leaves on its own thread while the simulation keeps using (and
+//refitting) the current one. Bodies added or removed in the meantime are reconciled when the result is swapped in.
+//The swap always happens swapDelay steps after the start, waiting for the thread if it is late, so pair order
+//and therefore the simulation doesn't depend on thread timing.
+class treeRebuildJob
+{
+public:
+	std::thread thread;
+	bool running = false;
+	int startStep = 0;
+	int swapDelay = 8;
+	std::vector<aabbTree::leafSnapshot> snapshot;
+	std::vector<int> leafOf;
+	aabbTree result;
+	float builtCost = 0; //cost() of result straight after the top-down build, before reconciliation
+	int builtLeaves = 0;
+
+	~treeRebuildJob()
+	{
+		if (thread.joinable())
+			thread.join();
+	}
+
+	void start(aabbTree& source)
+	{
+		snapshot.clear();
+		for (int i = 0; i < source.nodes.size(); i++)
+		{
+			if (source.nodes[i].height == 0)
+				snapshot.push_back({ source.nodes[i].box, source.nodes[i].circle, source.nodes[i].circle->id, i });
+		}
+		running = true;
+		startStep = physicsSimulationObject.stepCount;
+		thread = std::thread([this]() {
+			result.build(snapshot, leafOf);
+			builtCost = result.cost();
+			builtLeaves = snapshot.size();
+		});
+	}
+
+	//Swaps the finished tree into target and points every body's treeProxy at its new leaf
+	bool finish(aabbTree& target)
+	{
+		if (!running || physicsSimulationObject.stepCount < startStep + swapDelay)
+			return false;
+		thread.join();
+		running = false;
+
+		//A snapshot leaf survived if the same body still owns that node in the old tree
+		std::vector<int> remap(target.nodes.size(), -1);
+		std::vector<bool> removed(snapshot.size(), false);
+		for (int i = 0; i < snapshot.size(); i++)
+		{
+			aabbTree::node& old = target.nodes[snapshot[i].leaf];
+			if (old.height == 0 && old.circle && old.circle->id == snapshot[i].id)
+				remap[snapshot[i].leaf] = leafOf[i];
+			else
+				removed[i] = true;
+		}
+
+		std::swap(target.nodes, result.nodes);
+		std::swap(target.root, result.root);
+		std::swap(target.freeList, result.freeList);
+		target.refitQueue.clear();
+		for (int i = 0; i < snapshot.size(); i++)
+		{
+			if (removed[i])
+				target.remove(leafOf[i]);
+		}
+		for (int i = 0; i < pObjects.size(); i++)
+		{
+			int proxy = pObjects[i]->treeProxy;
+			if (proxy == -1)
+				continue;
+			if (remap[proxy] != -1)
+				pObjects[i]->treeProxy = remap[proxy];
+			else
+				pObjects[i]->treeProxy = target.insert((physicsCircle*)pObjects[i]);
+		}
+		return true;
+	}
+};
+
+treeRebuildJob treeRebuild;
+
+//Refitting keeps per-step cost low but lets the tree decay. Once cost() has grown past partialRebuildRatio
+//of what the last top-down build scored a few refitted leaves are reinserted each step, past fullRebuildRatio
+//the whole tree is rebuilt in the background. cost() still depends on how many leaves there are, so once the
+//count has drifted past leafDriftRatio from the build's the baseline is stale and a rebuild refreshes it.
+struct treeQualityPolicy
+{
+	float partialRebuildRatio = 1.1f;
+	float fullRebuildRatio = 1.3f;
+	float leafDriftRatio = 0.25f;
+	int reinsertBudget = 64; //Leaves reinserted per step while partially rebuilding
+	float baselineCost = 0; //cost() of the last top-down build
+	int baselineLeaves = 0; //Leaf count of that build, 0 until one has finished
+	float currentCost = 0;
+	int fullRebuilds = 0;
+	int reinserted = 0; //Last step
+};
+
+treeQualityPolicy treePolicy;
+
+void maintainTree()
+{
+	treePolicy.reinserted = 0;
+	if (!tree.refitLeaves || tree.root == -1)
+		return;
+
+	treePolicy.currentCost = tree.cost();
+	int leaves = tree.leafCount();
+	if (abs(leaves - treePolicy.baselineLeaves) > treePolicy.baselineLeaves * treePolicy.leafDriftRatio)
+	{
+		if (!treeRebuild.running)
+			treeRebuild.start(tree);
+		return;
+	}
+	//A single leaf has no internal nodes and costs 0, there is nothing to compare
+	if (treePolicy.baselineCost == 0)
+		return;
+	float ratio = treePolicy.currentCost / treePolicy.baselineCost;
+	if (ratio > treePolicy.fullRebuildRatio && !treeRebuild.running)
+		treeRebuild.start(tree);
+	else if (ratio > treePolicy.partialRebuildRatio)
+		treePolicy.reinserted = tree.reinsertRefitted(treePolicy.reinsertBudget);
+}
+
+//Refits every leaf its body has escaped, see aabbTree::move()
+void moveTreeLeaves()
+{
+	for (int i = 0; i < pObjects.size(); i++)
+	{
+		if (pObjects[i]->treeProxy != -1)
+			tree.move(pObjects[i]->treeProxy, pObjects[i]->velocity() * physicsSimulationObject.deltaTime);
+	}
+}
+
+//The tree doubles as the spatial index for queries, so it is brought up to date lazily, at most once per
+//step, by whichever of the broadphase or a query needs it first
+void syncTree()
+{
+	if (tree.syncedStep == physicsSimulationObject.stepCount)
+		return;
+	//Swapped in before the leaves are checked, its boxes are from when the snapshot was taken
+	if (treeRebuild.finish(tree))
+	{
+		treePolicy.fullRebuilds++;
+		treePolicy.baselineCost = treeRebuild.builtCost;
+		treePolicy.baselineLeaves = treeRebuild.builtLeaves;
+	}
+	moveTreeLeaves();
+	maintainTree();
+	tree.syncedStep = physicsSimulationObject.stepCount;
+}
+
+void findTreePairs(std::vector<bodyPair>& out)
+{
+	parallelPairs(tree.nodes.size(), [](std::vector<bodyPair>& pairs, int first, int last) {
+		thread_local std::vector<int> stack;
+		tree.findPairs(pairs, first, last, stack);
+	}, out);
+}
+
+//Verlet list: pairs within radius + skin are found once with the grid and reused until some circle has
+//moved more than half the skin since the build, after which two circles could have closed the whole gap.
+class neighborList
+{
+public:
+	float skin = 10;
+	bool dirty = true; //Set when bodies are added or removed, the stored pairs may hold deleted pointers
+	int stepsSinceBuild = 0;
+	std::vector<bodyPair> pairs;
+	std::vector<physicsCircle*> circles;
+	std::vector<Vector2> buildPositions;
+	float builtReach = 0; //Speculative reach of the two fastest bodies when the list was built, with headroom
+	float reachHeadroom = 1.25f; //So bodies speeding up under gravity don't force a rebuild every step
+
+	//Any pair's speculative reach is at most this while no body is faster than at build time
+	float largestReach(std::vector<physicsCircle*>& list)
+	{
+		float fastest = 0;
+		for (int i = 0; i < list.size(); i++)
+			fastest = fmaxf(fastest, speculativeReach(list[i]));
+		return 2 * fastest;
+	}
+
+	bool needsRebuild()
+	{
+		if (dirty)
+			return true;
+		if (largestReach(circles) > builtReach)
+			return true;
+		float limit = skin * 0.5f;
+		for (int i = 0; i < circles.size(); i++)
+		{
+			if (Vector2DistanceSqr(circles[i]->position(), buildPositions[i]) > limit * limit)
+				return true;
+		}
+		return false;
+	}
+
+	void build(std::vector<physicsSimulation::physicsBody*>& bodies)
+	{
+		pairs.clear();
+		float fastest = 0;
+		for (int i = 0; i < bodies.size(); i++)
+		{
+			if (bodies[i]->Shape() == CIRCLE)
+				fastest = fmaxf(fastest, speculativeReach((physicsCircle*)bodies[i]));
+		}
+		builtReach = 2 * fastest * reachHeadroom;
+		grid.build(bodies, skin + builtReach);
+		findGridPairs(pairs);
+
+		//The grid only narrows things to neighbouring cells, keep the pairs actually within reach
+		int write = 0;
+		for (int i = 0; i < pairs.size(); i++)
+		{
+			physicsCircle* circleA = (physicsCircle*)pairs[i].a;
+			physicsCircle* circleB = (physicsCircle*)pairs[i].b;
+			float reach = circleA->radius + circleB->radius + skin + builtReach;
+			if (Vector2DistanceSqr(circleA->position(), circleB->position()) < reach * reach)
+				pairs[write++] = pairs[i];
+		}
+		pairs.resize(write);
+
+		circles = grid.circles;
+		buildPositions.resize(circles.size());
+		for (int i = 0; i < circles.size(); i++)
+			buildPositions[i] = circles[i]->position();
+		dirty = false;
+		stepsSinceBuild = 0;
+	}
+
+	void findPairs(std::vector<physicsSimulation::physicsBody*>& bodies, std::vector<bodyPair>& out)
+	{
+		if (needsRebuild())
+			build(bodies);
+		else
+			stepsSinceBuild++;
+		out.insert(out.end(), pairs.begin(), pairs.end());
+	}
+};
+
+neighborList neighbors;
+
+//Where collision() spends its work each frame: narrowphase tests against actual overlaps per shape pair, and
+//how bodies are spread over a uniform grid, so badly pruned regions show up
+struct collisionStatistics
+{
+	struct cellCount
+	{
+		int x;
+		int y;
+		int count;
+	};
+
+	bool occupancy = false; //The grid histogram sorts every body, only gathered while the overlay is shown
+	bool heatmap = false;
+	float cellSize = 50;
+	int tested[SHAPE_COUNT][SHAPE_COUNT] = {}; //Lower shape first
+	int overlapping[SHAPE_COUNT][SHAPE_COUNT] = {};
+	std::vector<unsigned long long> cellKeys;
+	std::vector<cellCount> cells; //Occupied cells only
+	static constexpr int histogramSize = 16; //Last bucket also holds every fuller cell
+	int histogram[histogramSize + 1] = {}; //histogram[k] = cells holding k bodies
+	static constexpr int densestCount = 5;
+	cellCount densest[densestCount] = {};
+
+	void reset()
+	{
+		for (int a = 0; a < SHAPE_COUNT; a++)
+		{
+			for (int b = 0; b < SHAPE_COUNT; b++)
+			{
+				tested[a][b] = 0;
+				overlapping[a][b] = 0;
+			}
+		}
+	}
+
+	void record(int shapeA, int shapeB, int testCount, int overlapCount)
+	{
+		tested[std::min(shapeA, shapeB)][std::max(shapeA, shapeB)] += testCount;
+		overlapping[std::min(shapeA, shapeB)][std::max(shapeA, shapeB)] += overlapCount;
+	}
+
+	void buildOccupancy(std::vector<physicsSimulation::physicsBody*>& bodies)
+	{
+		cellKeys.clear();
+		for (int i = 0; i < bodies.size(); i++)
+		{
+			//Sensors stay out of the grid, see spatialHashGrid::build()
+			if (bodies[i]->Shape() != CIRCLE || bodies[i]->sensor)
+				continue;
+			//Offset so negative cells still sort in order once packed
+			unsigned int x = (unsigned int)((int)floorf(bodies[i]->position().x / cellSize) + 0x40000000);
+			unsigned int y = (unsigned int)((int)floorf(bodies[i]->position().y / cellSize) + 0x40000000);
+			cellKeys.push_back((unsigned long long)x << 32 | y);
+		}
+		std::sort(cellKeys.begin(), cellKeys.end());
+
+		cells.clear();
+		for (int i = 0; i < cellKeys.size();)
+		{
+			int run = i;
+			while (run < cellKeys.size() && cellKeys[run] == cellKeys[i])
+				run++;
+			cells.push_back({ (int)(cellKeys[i] >> 32) - 0x40000000, (int)(cellKeys[i] & 0xFFFFFFFF) - 0x40000000, run - i });
+			i = run;
+		}
+
+		for (int k = 0; k <= histogramSize; k++)
+			histogram[k] = 0;
+		for (int i = 0; i < cells.size(); i++)
+			histogram[std::min(cells[i].count, histogramSize)]++;
+
+		int found = std::min((int)cells.size(), densestCount);
+		std::partial_sort_copy(cells.begin(), cells.end(), densest, densest + found,
+			[](const cellCount& a, const cellCount& b) { return a.count > b.count; });
+		for (int k = found; k < densestCount; k++)
+			densest[k] = { 0, 0, 0 };
+	}
+
+	void drawHeatmap()
+	{
+		int peak = densest[0].count;
+		for (int i = 0; i < cells.size(); i++)
+		{
+			Rectangle cell = { cells[i].x * cellSize, cells[i].y * cellSize, cellSize, cellSize };
+			DrawRectangleRec(cell, Fade(ORANGE, 0.1f + 0.6f * cells[i].count / peak));
+		}
+		for (int k = 0; k < densestCount && densest[k].count > 0; k++)
+			DrawRectangleLinesEx({ densest[k].x * cellSize, densest[k].y * cellSize, cellSize, cellSize }, 2, YELLOW);
+	}
+
+	void drawOverlay(int x, int y)
+	{
+		const char* names[SHAPE_COUNT] = { "Circle", "Plane" };
+		for (int a = 0; a < SHAPE_COUNT; a++)
+		{
+			for (int b = a; b < SHAPE_COUNT; b++)
+			{
+				if (!tested[a][b])
+					continue;
+				DrawText(TextFormat("%s-%s: %i tested, %i hit (%.1f%%)", names[a], names[b], tested[a][b], overlapping[a][b], 100.0f * overlapping[a][b] / tested[a][b]), x, y, 20, LIGHTGRAY);
+				y += 25;
+			}
+		}
+		if (!occupancy || cells.empty())
+			return;
+
+		DrawText(TextFormat("Occupied cells: %i, densest %i at (%i, %i)", (int)cells.size(), densest[0].count, densest[0].x, densest[0].y), x, y, 20, LIGHTGRAY);
+		y += 25;
+
+		//Bodies per cell, 1 to 16+, bar height relative to the most common count
+		int tallest = 1;
+		for (int k = 1; k <= histogramSize; k++)
+			tallest = std::max(tallest, histogram[k]);
+		const int barWidth = 14;
+		const int barHeight = 60;
+		for (int k = 1; k <= histogramSize; k++)
+		{
+			int height = barHeight * histogram[k] / tallest;
+			DrawRectangle(x + (k - 1) * (barWidth + 2), y + barHeight - height, barWidth, height, SKYBLUE);
+		}
+		DrawText("1", x, y + barHeight + 2, 10, LIGHTGRAY);
+		DrawText("16+", x + (histogramSize - 1) * (barWidth + 2), y + barHeight + 2, 10, LIGHTGRAY);
+	}
+};
+
+collisionStatistics collisionStats;
+
+//Picks the broadphase from what the scene looks like: very uneven radii suit the tree (grid cells are sized
+//for the largest circle), sparse scenes suit sweep and prune, everything else the grid. A broadphase whose
+//pair yield turns out poor is benched for a while. A new choice has to win several samples in a row and the
+//thresholds lean towards the current choice, so borderline scenes don't flip every sample.
+struct broadphaseSelector
+{
+	bool enabled = false;
+	int sampleInterval = 30; //Steps between samples
+	int confirmSamples = 3;
+	int benchSamples = 10; //How long a broadphase with poor yield is left out
+	float radiusVariation = 0; //Standard deviation over mean
+	float bodiesPerCell = 0; //Mean over occupied cells two mean radii wide
+	float pairYield = 0; //Circle pairs that overlapped over circle pairs the current broadphase produced
+	int pending = -1;
+	int pendingCount = 0;
+	int switches = 0;
+	int samples = 0;
+	int benchedUntil[NEIGHBOR_LIST + 1] = {};
+	collisionStatistics sampleGrid;
+
+	//Reads last step's collisionStats, so it has to run before collision() resets them
+	void sample()
+	{
+		int circles = 0;
+		float sum = 0;
+		float sumSquares = 0;
+		for (int i = 0; i < pObjects.size(); i++)
+		{
+			//A large trigger zone would otherwise make same-sized balls look like a mixed scene
+			if (pObjects[i]->Shape() != CIRCLE || pObjects[i]->sensor)
+				continue;
+			float radius = ((physicsCircle*)pObjects[i])->radius;
+			circles++;
+			sum += radius;
+			sumSquares += radius * radius;
+		}
+		if (circles < 2)
+			return;
+		float mean = sum / circles;
+		radiusVariation = sqrtf(fmaxf(sumSquares / circles - mean * mean, 0)) / mean;
+
+		sampleGrid.cellSize = 2 * mean;
+		sampleGrid.buildOccupancy(pObjects);
+		bodiesPerCell = (float)circles / sampleGrid.cells.size();
+
+		int current = physicsSimulationObject.broadphase;
+		int tested = collisionStats.tested[CIRCLE][CIRCLE];
+		pairYield = tested ? (float)collisionStats.overlapping[CIRCLE][CIRCLE] / tested : 1;
+		samples++;
+		if (tested > circles && pairYield < (current == SWEEP_AND_PRUNE ? 0.02f : 0.05f))
+			benchedUntil[current] = samples + benchSamples;
+
+		int choice = choose(current);
+		if (choice == current)
+		{
+			pending = -1;
+			pendingCount = 0;
+			return;
+		}
+		pendingCount = choice == pending ? pendingCount + 1 : 1;
+		pending = choice;
+		if (pendingCount >= confirmSamples || benchedUntil[current] > samples)
+		{
+			physicsSimulationObject.broadphase = choice;
+			pending = -1;
+			pendingCount = 0;
+			switches++;
+		}
+	}
+
+	int choose(int current)
+	{
+		if (radiusVariation > (current == AABB_TREE ? 0.35f : 0.5f) && benchedUntil[AABB_TREE] <= samples)
+			return AABB_TREE;
+		if (bodiesPerCell < (current == SWEEP_AND_PRUNE ? 1.5f : 1.2f) && benchedUntil[SWEEP_AND_PRUNE] <= samples)
+			return SWEEP_AND_PRUNE;
+		if (benchedUntil[SPATIAL_GRID] <= samples)
+			return SPATIAL_GRID;
+		return AABB_TREE;
+	}
+};
+
+broadphaseSelector broadphaseSelection;
+
+std::vector<physicsHalfspace*> halfspaces;
+
+//Halfspaces flattened to (normal, offset) with dot(normal, p) = offset on the surface. Kept apart from the
+//pair loop since an infinite plane overlaps every cell of any spatial structure.
+struct planeSet
+{
+	std::vector<float> normalX;
+	std::vector<float> normalY;
+	std::vector<float> offset;
+
+	void build(std::vector<physicsHalfspace*>& source)
+	{
+		normalX.resize(source.size());
+		normalY.resize(source.size());
+		offset.resize(source.size());
+		for (int i = 0; i < source.size(); i++)
+		{
+			Vector2 normal = source[i]->getNormal();
+			normalX[i] = normal.x;
+			normalY[i] = normal.y;
+			offset[i] = Vector2DotProduct(normal, source[i]->position());
+		}
+	}
+};
+
+//Circle positions and radii gathered into flat arrays so the plane test is a branch-free loop
+struct circleBatch
+{
+	std::vector<physicsCircle*> circles;
+	std::vector<float> positionX;
+	std::vector<float> positionY;
+	std::vector<float> radius;
+	std::vector<unsigned int> category;
+	std::vector<unsigned int> mask;
+	std::vector<float> depth;
+
+	void gather(std::vector<physicsSimulation::physicsBody*>& bodies)
+	{
+		circles.clear();
+		positionX.clear();
+		positionY.clear();
+		radius.clear();
+		category.clear();
+		mask.clear();
+		for (int i = 0; i < bodies.size(); i++)
+		{
+			//Sensors never get pushed out of planes
+			if (bodies[i]->Shape() != CIRCLE || bodies[i]->sensor)
+				continue;
+			physicsCircle* circle = (physicsCircle*)bodies[i];
+			circles.push_back(circle);
+			positionX.push_back(circle->position().x);
+			positionY.push_back(circle->position().y);
+			radius.push_back(circle->radius);
+			category.push_back(circle->collisionCategory);
+			mask.push_back(circle->collisionMask);
+		}
+		depth.resize(circles.size());
+	}
+};
+
+planeSet planes;
+circleBatch planeBatch;
+
+//Tests every plane against every circle. The depth loop has no branches or pointer chasing so the compiler
+//can vectorize it, only circles that actually penetrate go through the scalar response.
+int planeCollision()
+{
+	planes.build(halfspaces);
+	planeBatch.gather(pObjects);
+
+	int count = planeBatch.circles.size();
+	bool speculative = physicsSimulationObject.continuousCollision == CCD_SPECULATIVE;
+	float* positionX = planeBatch.positionX.data();
+	float* positionY = planeBatch.positionY.data();
+	float* radius = planeBatch.radius.data();
+	float* depth = planeBatch.depth.data();
+
+	for (int p = 0; p < planes.offset.size(); p++)
+	{
+		float nx = planes.normalX[p];
+		float ny = planes.normalY[p];
+		float offset = planes.offset[p];
+		unsigned int planeCategory = halfspaces[p]->collisionCategory;
+		unsigned int planeMask = halfspaces[p]->collisionMask;
+
+		for (int i = 0; i < count; i++)
+			depth[i] = radius[i] - (positionX[i] * nx + positionY[i] * ny - offset);
+
+		int tested = 0;
+		int hits = 0;
+		for (int i = 0; i < count; i++)
+		{
+			if (!(planeBatch.category[i] & planeMask) || !(planeCategory & planeBatch.mask[i]))
+			{
+				physicsSimulationObject.pairsFiltered++;
+				continue;
+			}
+			tested++;
+			if (depth[i] > 0)
+			{
+				hits++;
+				physicsCircle* circle = planeBatch.circles[i];
+				halfspaceContactResponse(circle, halfspaces[p], { nx, ny }, depth[i]);
+				//Later planes need to see where this one pushed the circle
+				positionX[i] = circle->position().x;
+				positionY[i] = circle->position().y;
+			}
+			else if (speculative)
+			{
+				physicsCircle* circle = planeBatch.circles[i];
+				float closing = -(circle->velocity().x * nx + circle->velocity().y * ny) * physicsSimulationObject.deltaTime;
+				if (closing > -depth[i])
+				{
+					addContact(circle, halfspaces[p], Vector2{ nx, ny } * -1, circle->coefficientOfFriction, -depth[i]);
+					physicsSimulationObject.speculativeContacts++;
+				}
+			}
+		}
+		collisionStats.record(CIRCLE, HALFSPACE, tested, hits);
+	}
+	return count * planes.offset.size();
+}
+
+//Every body enters and leaves the simulation through these so persistent broadphases stay in sync
+void addBody(physicsSimulation::physicsBody* body)
+{
+	body->id = nextBodyId++;
+	body->handle = physicsSimulationObject.handles.create(body);
+	pObjects.push_back(body);
+	neighbors.dirty = true;
+	if (body->Shape() == HALFSPACE)
+		halfspaces.push_back((physicsHalfspace*)body);
+	if (body->Shape() == CIRCLE)
+	{
+		sap.insert((physicsCircle*)body);
+		body->treeProxy = tree.insert((physicsCircle*)body);
+	}
+}
+
+//Removal is split in two so a mass exit costs one pass over the body list instead of one erase per body.
+//removeBody() only marks the body and detaches it from the tree, which is O(log n) on its own.
+int pendingRemovals = 0;
+
+void removeBody(physicsSimulation::physicsBody* body)
+{
+	if (body->pendingRemoval)
+		return;
+	body->pendingRemoval = true;
+	pendingRemovals++;
+	physicsSimulationObject.handles.destroy(body->handle);
+	if (body->treeProxy != -1)
+	{
+		tree.remove(body->treeProxy);
+		body->treeProxy = -1;
+	}
+}
+
+//Compacts every list that holds marked bodies in one stable pass each, then frees them. Order is kept
+//so the surviving bodies are visited exactly as they were before.
+void flushRemovals()
+{
+	if (pendingRemovals == 0)
+		return;
+	neighbors.dirty = true;
+	sap.removeMarked();
+	halfspaces.erase(std::remove_if(halfspaces.begin(), halfspaces.end(),
+		[](physicsHalfspace* halfspace) { return halfspace->pendingRemoval; }), halfspaces.end());
+
+	int write = 0;
+	for (int i = 0; i < pObjects.size(); i++)
+	{
+		if (pObjects[i]->pendingRemoval)
+			delete pObjects[i];
+		else
+			pObjects[write++] = pObjects[i];
+	}
+	pObjects.resize(write);
+	pendingRemovals = 0;
+}
+
+struct overlapEvent
+{
+	unsigned int sensorId;
+	unsigned int otherId; //May already be deleted for end events
+	bool begin;
+};
+
+//Fixed capacity single-producer single-consumer queue. The producer only writes head and the consumer only
+//writes tail, so the two sides never need a lock. Events that don't fit are counted and dropped.
+template <typename T, unsigned int Capacity>
+class eventRing
+{
+public:
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+	T events[Capacity];
+	std::atomic<unsigned int> head{ 0 };
+	std::atomic<unsigned int> tail{ 0 };
+	unsigned int dropped = 0; //Only touched by the producer
+
+	bool push(const T& event)
+	{
+		unsigned int h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == Capacity)
+		{
+			dropped++;
+			return false;
+		}
+		events[h & (Capacity - 1)] = event;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T& event)
+	{
+		unsigned int t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+			return false;
+		event = events[t & (Capacity - 1)];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+struct sensorOverlap
+{
+	unsigned int sensorId = 0;
+	unsigned int otherId = 0;
+};
+
+pairMap<sensorOverlap> sensorOverlaps;
+eventRing<overlapEvent, 1024> overlapEvents;
+
+//Records a sensor pair that overlaps this step. Only circle sensors are supported.
+bool sensorTest(physicsSimulation::physicsBody* objectA, physicsSimulation::physicsBody* objectB)
+{
+	if (objectA->Shape() != CIRCLE || objectB->Shape() != CIRCLE)
+		return false;
+	physicsCircle* circleA = (physicsCircle*)objectA;
+	physicsCircle* circleB = (physicsCircle*)objectB;
+	float sumRadii = circleA->radius + circleB->radius;
+	if (Vector2DistanceSqr(circleA->position(), circleB->position()) >= sumRadii * sumRadii)
+		return false;
+
+	pairMap<sensorOverlap>::entry* slot = sensorOverlaps.insert(pairKey(objectA, objectB));
+	slot->value.sensorId = objectA->sensor ? objectA->id : objectB->id;
+	slot->value.otherId = objectA->sensor ? objectB->id : objectA->id;
+	return true;
+}
+
+//Compares this step's sensor overlaps with last step's, queuing begin events for new pairs and end events
+//for pairs that stopped overlapping (or whose body was deleted)
+void emitOverlapEvents()
+{
+	for (int i = 0; i < sensorOverlaps.current.size(); i++)
+	{
+		pairMap<sensorOverlap>::entry& overlap = sensorOverlaps.current[i];
+		if (overlap.key != 0 && !sensorOverlaps.find(sensorOverlaps.previous, overlap.key))
+			overlapEvents.push({ overlap.value.sensorId, overlap.value.otherId, true });
+	}
+	for (int i = 0; i < sensorOverlaps.previous.size(); i++)
+	{
+		pairMap<sensorOverlap>::entry& overlap = sensorOverlaps.previous[i];
+		if (overlap.key != 0 && !sensorOverlaps.find(sensorOverlaps.current, overlap.key))
+			overlapEvents.push({ overlap.value.sensorId, overlap.value.otherId, false });
+	}
+}
+
+//A separated pair whose gap can't close before wakeStep, given the speeds both circles had at scheduledStep
+//and gravity speeding them up since. Only holds while neither circle gets pushed by anything else and gravity
+//stays no stronger than it was when the bound was worked out.
+struct pairSchedule
+{
+	int wakeStep;
+	int scheduledStep;
+	float gravity; //|gravAccel| at scheduledStep
+};
+
+pairMap<pairSchedule> pairSchedules;
+
+//Returns true while the pair is known to be apart. Has to be called once the responses ahead of the pair this
+//step have run, so a push from one of them (disturbedStep == stepCount) keeps the pair in. Otherwise the pair
+//is tested as usual, and if it is separated the number of steps it is guaranteed to stay that way is worked
+//out for next time.
+bool skipScheduledPair(physicsCircle* circleA, physicsCircle* circleB)
+{
+	unsigned long long key = pairKey(circleA, circleB);
+	int step = physicsSimulationObject.stepCount;
+	float gravity = Vector2Length(physicsSimulationObject.gravAccel);
+	pairMap<pairSchedule>::entry* scheduled = pairSchedules.find(pairSchedules.previous, key);
+	//Raising gravity with the slider counts as disturbing every pair
+	if (scheduled && step < scheduled->value.wakeStep && gravity <= scheduled->value.gravity
+		&& circleA->disturbedStep < scheduled->value.scheduledStep && circleB->disturbedStep < scheduled->value.scheduledStep)
+	{
+		pairSchedules.insert(key)->value = scheduled->value;
+		return true;
+	}
+
+	float gap = Vector2Distance(circleA->position(), circleB->position()) - circleA->radius - circleB->radius;
+	if (gap <= 0)
+		return false;
+
+	//After j steps the gap has closed by at most j*dt*(|vA| + |vB|) plus what gravity added to both speeds,
+	//which is under 2*|g|*dt^2*j^2. The first j where that could reach the gap is when the pair wakes up.
+	float dt = physicsSimulationObject.deltaTime;
+	float linear = (Vector2Length(circleA->velocity()) + Vector2Length(circleB->velocity())) * dt;
+	float quadratic = 2 * gravity * dt * dt;
+	float reach = gap * 0.9f; //Margin for rounding
+	float steps;
+	if (quadratic > 0)
+		steps = (-linear + sqrtf(linear * linear + 4 * quadratic * reach)) / (2 * quadratic);
+	else
+		steps = linear > 0 ? reach / linear : INFINITY;
+	const int maxSkip = 60;
+	int wake = step + (int)ceilf(fminf(steps, maxSkip));
+	//Speculative contacts look one step ahead, so the pair has to be back in the loop a step earlier
+	if (physicsSimulationObject.continuousCollision == CCD_SPECULATIVE)
+		wake--;
+	if (wake > step + 1)
+		pairSchedules.insert(key)->value = { wake, step, gravity };
+	return false;
+}
+
+//Circle pairs that survived the broadphase and the filters, with both circles' positions and radii gathered
+//into flat arrays so the overlap test can run several pairs per instruction. The pair lists grow as pairs are
+//found; the gathered arrays are sized once the count is known and come from the frame arena.
+struct circlePairBatch
+{
+	std::vector<physicsCircle*> a;
+	std::vector<physicsCircle*> b;
+	float* positionAX = nullptr;
+	float* positionAY = nullptr;
+	float* radiusA = nullptr;
+	float* positionBX = nullptr;
+	float* positionBY = nullptr;
+	float* radiusB = nullptr;
+
+	void clear()
+	{
+		a.clear();
+		b.clear();
+	}
+
+	void add(physicsCircle* circleA, physicsCircle* circleB)
+	{
+		a.push_back(circleA);
+		b.push_back(circleB);
+	}
+
+	//Done once every pair is known so the kernels read contiguous memory instead of chasing body pointers
+	void gather()
+	{
+		int count = a.size();
+		physicsSimulation::frameArena& arena = physicsSimulationObject.arena;
+		positionAX = arena.allocate<float>(count);
+		positionAY = arena.allocate<float>(count);
+		radiusA = arena.allocate<float>(count);
+		positionBX = arena.allocate<float>(count);
+		positionBY = arena.allocate<float>(count);
+		radiusB = arena.allocate<float>(count);
+		for (int i = 0; i < count; i++)
+		{
+			positionAX[i] = a[i]->position().x;
+			positionAY[i] = a[i]->position().y;
+			radiusA[i] = a[i]->radius;
+			positionBX[i] = b[i]->position().x;
+			positionBY[i] = b[i]->position().y;
+			radiusB[i] = b[i]->radius;
+		}
+	}
+};
+
+//Compact output of the batched kernels, one per overlapping pair
+struct narrowphaseContact
+{
+	int pair; //Index into the circlePairBatch
+	float normalX; //A to B
+	float normalY;
+	float overlap;
+};
+
+circlePairBatch narrowphasePairs;
+
+//Reference kernel, same math as circleCircleCollisionResponse. Handles pairs [first, last) and returns how many records it wrote.
+int narrowphaseScalar(const circlePairBatch& batch, int first, int last, narrowphaseContact* out)
+{
+	int found = 0;
+	for (int i = first; i < last; i++)
+	{
+		float dx = batch.positionBX[i] - batch.positionAX[i];
+		float dy = batch.positionBY[i] - batch.positionAY[i];
+		float distance = sqrtf(dx * dx + dy * dy);
+		float overlap = batch.radiusA[i] + batch.radiusB[i] - distance;
+		if (overlap > 0)
+		{
+			if (!distance)
+				out[found] = { i, 0, 1, overlap };
+			else
+				out[found] = { i, dx / distance, dy / distance, overlap };
+			found++;
+		}
+	}
+	return found;
+}
+
+//Same results as narrowphaseScalar, 8 pairs at a time with AVX2 or 4 with SSE. Uses a real divide and sqrt
+//rather than the reciprocal estimates so the records match the reference. Targets without either (ARM64)
+//and the leftover pairs go through the scalar kernel.
+int narrowphaseSimd(const circlePairBatch& batch, narrowphaseContact* out)
+{
+	int count = batch.a.size();
+	int i = 0;
+	int found = 0;
+#if defined(NARROWPHASE_AVX2)
+	const __m256 zero8 = _mm256_setzero_ps();
+	const __m256 one8 = _mm256_set1_ps(1.0f);
+	alignas(32) float normalX8[8];
+	alignas(32) float normalY8[8];
+	alignas(32) float overlap8[8];
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&batch.positionBX[i]), _mm256_loadu_ps(&batch.positionAX[i]));
+		__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&batch.positionBY[i]), _mm256_loadu_ps(&batch.positionAY[i]));
+		__m256 distance = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)));
+		__m256 overlap = _mm256_sub_ps(_mm256_add_ps(_mm256_loadu_ps(&batch.radiusA[i]), _mm256_loadu_ps(&batch.radiusB[i])), distance);
+		int hits = _mm256_movemask_ps(_mm256_cmp_ps(overlap, zero8, _CMP_GT_OQ));
+		if (!hits)
+			continue;
+		//Coincident centres divide by zero, those lanes get the same {0, 1} normal the scalar path uses
+		__m256 coincident = _mm256_cmp_ps(distance, zero8, _CMP_EQ_OQ);
+		__m256 normalX = _mm256_andnot_ps(coincident, _mm256_div_ps(dx, distance));
+		__m256 normalY = _mm256_blendv_ps(_mm256_div_ps(dy, distance), one8, coincident);
+		_mm256_store_ps(normalX8, normalX);
+		_mm256_store_ps(normalY8, normalY);
+		_mm256_store_ps(overlap8, overlap);
+		for (int lane = 0; lane < 8; lane++)
+		{
+			if (hits & (1 << lane))
+				out[found++] = { i + lane, normalX8[lane], normalY8[lane], overlap8[lane] };
+		}
+	}
+#endif
+#if defined(NARROWPHASE_AVX2) || defined(NARROWPHASE_SSE)
+	const __m128 zero4 = _mm_setzero_ps();
+	const __m128 one4 = _mm_set1_ps(1.0f);
+	alignas(16) float normalX4[4];
+	alignas(16) float normalY4[4];
+	alignas(16) float overlap4[4];
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(&batch.positionBX[i]), _mm_loadu_ps(&batch.positionAX[i]));
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(&batch.positionBY[i]), _mm_loadu_ps(&batch.positionAY[i]));
+		__m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+		__m128 overlap = _mm_sub_ps(_mm_add_ps(_mm_loadu_ps(&batch.radiusA[i]), _mm_loadu_ps(&batch.radiusB[i])), distance);
+		int hits = _mm_movemask_ps(_mm_cmpgt_ps(overlap, zero4));
+		if (!hits)
+			continue;
+		//SSE2 has no blend, select with and/andnot/or instead
+		__m128 coincident = _mm_cmpeq_ps(distance, zero4);
+		__m128 normalX = _mm_andnot_ps(coincident, _mm_div_ps(dx, distance));
+		__m128 normalY = _mm_or_ps(_mm_and_ps(coincident, one4), _mm_andnot_ps(coincident, _mm_div_ps(dy, distance)));
+		_mm_store_ps(normalX4, normalX);
+		_mm_store_ps(normalY4, normalY);
+		_mm_store_ps(overlap4, overlap);
+		for (int lane = 0; lane < 4; lane++)
+		{
+			if (hits & (1 << lane))
+				out[found++] = { i + lane, normalX4[lane], normalY4[lane], overlap4[lane] };
+		}
+	}
+#endif
+	return found + narrowphaseScalar(batch, i, count, out + found);
+}
+
+//Speculative contacts need velocities and separated pairs, which the batched kernels don't produce, and the
+//brute-force loop dispatches pairs one at a time, so both run sequentially whatever kernel is selected
+bool batchedNarrowphaseActive()
+{
+	return physicsSimulationObject.narrowphase != NARROWPHASE_SEQUENTIAL
+		&& physicsSimulationObject.continuousCollision != CCD_SPECULATIVE
+		&& physicsSimulationObject.broadphase != BRUTE_FORCE;
+}
+
+//Runs the selected kernel over narrowphasePairs and applies the responses. Every record is computed from the
+//positions at gather time, so pushes within a step don't see each other the way the sequential path does.
+void batchedNarrowphase()
+{
+	int count = narrowphasePairs.a.size();
+	if (!count)
+		return;
+	narrowphasePairs.gather();
+	narrowphaseContact* records = physicsSimulationObject.arena.allocate<narrowphaseContact>(count);
+
+	double kernelStart = GetTime();
+	int found;
+	if (physicsSimulationObject.narrowphase == NARROWPHASE_SIMD)
+		found = narrowphaseSimd(narrowphasePairs, records);
+	else
+		found = narrowphaseScalar(narrowphasePairs, 0, count, records);
+	physicsSimulationObject.narrowphaseTime = (float)((GetTime() - kernelStart) * 1000.0);
+
+	//The scalar kernel is the reference, checking it against itself would always agree
+	if (physicsSimulationObject.verifyNarrowphase && physicsSimulationObject.narrowphase == NARROWPHASE_SIMD)
+	{
+		narrowphaseContact* reference = physicsSimulationObject.arena.allocate<narrowphaseContact>(count);
+		int expected = narrowphaseScalar(narrowphasePairs, 0, count, reference);
+		int mismatches = abs(expected - found);
+		for (int i = 0; i < found && i < expected; i++)
+		{
+			narrowphaseContact& x = records[i];
+			narrowphaseContact& y = reference[i];
+			if (x.pair != y.pair || fabsf(x.normalX - y.normalX) > 1e-5f || fabsf(x.normalY - y.normalY) > 1e-5f || fabsf(x.overlap - y.overlap) > 1e-4f)
+				mismatches++;
+		}
+		physicsSimulationObject.narrowphaseMismatches = mismatches;
+	}
+
+	collisionStats.record(CIRCLE, CIRCLE, count, found);
+
+	for (int i = 0; i < found; i++)
+	{
+		narrowphaseContact& record = records[i];
+		circleCircleContactResponse(narrowphasePairs.a[record.pair], narrowphasePairs.b[record.pair], { record.normalX, record.normalY }, record.overlap);
+	}
+}
+
+void findSensorOverlaps(); //Uses queryCircle(), which comes later
+
+void collision()
+{
+	for (int i = 0; i < pObjects.size(); i++)
+	{
+		//pObjects[i]->color = GREEN;
+	}
+	contacts.clear();
+	contactCacheObject.beginStep();
+	sensorOverlaps.beginStep();
+	physicsSimulationObject.speculativeContacts = 0;
+	physicsSimulationObject.pairsFiltered = 0;
+	if (broadphaseSelection.enabled && physicsSimulationObject.broadphase != BRUTE_FORCE && physicsSimulationObject.stepCount % broadphaseSelection.sampleInterval == 0)
+		broadphaseSelection.sample();
+	pairSchedules.beginStep();
+	physicsSimulationObject.pairsSkipped = 0;
+	collisionStats.reset();
+	if (collisionStats.occupancy)
+		collisionStats.buildOccupancy(pObjects);
+
+	if (physicsSimulationObject.broadphase == BRUTE_FORCE)
+	{
+		int tested = 0;
+		for (int i = 0; i < pObjects.size(); i++)
+		{
+			for (int j = 0; j < pObjects.size(); j++)
+			{
+				physicsSimulation::physicsBody* objectA = pObjects[i];
+				physicsSimulation::physicsBody* objectB = pObjects[j];
+
+				//Sensors don't detect each other, as in findSensorOverlaps()
+				if (i == j || (objectA->sensor && objectB->sensor))
+					continue;
+				//Halfspaces are handled, and filtered, by planeCollision()
+				if (objectA->Shape() == HALFSPACE || objectB->Shape() == HALFSPACE)
+					continue;
+				if (!shouldCollide(objectA, objectB))
+				{
+					physicsSimulationObject.pairsFiltered++;
+					continue;
+				}
+				if (objectA->sensor || objectB->sensor)
+				{
+					collisionStats.record(objectA->Shape(), objectB->Shape(), 1, sensorTest(objectA, objectB));
+					continue;
+				}
+
+				bool didOverlap = collisionResponse(objectA, objectB);
+				collisionStats.record(objectA->Shape(), objectB->Shape(), 1, didOverlap);
+				tested++;
+
+				if (didOverlap)
+				{
+					//objectA->color = RED;
+					//objectB->color = RED;
+				}
+			}
+		}
+		physicsSimulationObject.pairsTested = tested + planeCollision();
+		emitOverlapEvents();
+		return;
+	}
+
+	candidatePairs.clear();
+	if (physicsSimulationObject.broadphase == SPATIAL_GRID)
+	{
+		//Two circles can close at most twice the fastest one's reach in a step
+		float margin = 0;
+		for (int i = 0; i < pObjects.size(); i++)
+		{
+			if (pObjects[i]->Shape() == CIRCLE)
+				margin = fmaxf(margin, 2 * speculativeReach((physicsCircle*)pObjects[i]));
+		}
+		grid.build(pObjects, margin);
+		findGridPairs(candidatePairs);
+	}
+	else if (physicsSimulationObject.broadphase == SWEEP_AND_PRUNE)
 	{
-		position = conPosition;
-		velocity = conVelocity;
-		radius = conRadius;
-		coefficientOfFriction = conCoefficientOfFriction;
-		mass = conMass;
-		color = conColor;
+		sap.update();
+		sap.findPairs(candidatePairs);
 	}
-	void draw() override
+	else if (physicsSimulationObject.broadphase == AABB_TREE)
 	{
-		DrawCircle(position.x, position.y, radius, color);
-		DrawLineEx(position, position + velocity, 1, RED);
+		syncTree();
+		findTreePairs(candidatePairs);
 	}
-	physicsShape Shape() override
+	else if (physicsSimulationObject.broadphase == NEIGHBOR_LIST)
+		neighbors.findPairs(pObjects, candidatePairs);
+
+	bool batched = batchedNarrowphaseActive();
+	narrowphasePairs.clear();
+	int tested = 0;
+	for (int i = 0; i < candidatePairs.size(); i++)
 	{
-		return CIRCLE;
+		physicsSimulation::physicsBody* objectA = candidatePairs[i].a;
+		physicsSimulation::physicsBody* objectB = candidatePairs[i].b;
+		//The grid never produces these, SAP and the tree still do
+		if (objectA->sensor || objectB->sensor)
+			continue;
+		if (!shouldCollide(objectA, objectB))
+		{
+			physicsSimulationObject.pairsFiltered++;
+			continue;
+		}
+		if (batched && objectA->Shape() == CIRCLE && objectB->Shape() == CIRCLE)
+		{
+			//The kernels test every pair at gather-time positions anyway, so the schedule can be checked here.
+			//Bucketed pairs are checked in collideBucket(), after the responses before them.
+			if (skipPair((physicsCircle*)objectA, (physicsCircle*)objectB))
+			{
+				physicsSimulationObject.pairsSkipped++;
+				continue;
+			}
+			narrowphasePairs.add((physicsCircle*)objectA, (physicsCircle*)objectB);
+		}
+		else if (objectA->Shape() <= objectB->Shape())
+			pairBuckets[objectA->Shape()][objectB->Shape()].push_back({ objectA, objectB });
+		else
+			pairBuckets[objectB->Shape()][objectA->Shape()].push_back({ objectB, objectA });
+		tested++;
 	}
-};
+	//Before any responses move bodies, as when sensor pairs came through the loop above
+	findSensorOverlaps();
+	if (batched)
+		batchedNarrowphase();
+	for (int a = 0; a < SHAPE_COUNT; a++)
+	{
+		for (int b = a; b < SHAPE_COUNT; b++)
+		{
+			if (pairBuckets[a][b].empty())
+				continue;
+			if (bucketTable[a][b])
+			{
+				int skippedBefore = physicsSimulationObject.pairsSkipped;
+				int overlaps = bucketTable[a][b](pairBuckets[a][b]);
+				int skipped = physicsSimulationObject.pairsSkipped - skippedBefore;
+				collisionStats.record(a, b, pairBuckets[a][b].size() - skipped, overlaps);
+				tested -= skipped;
+			}
+			pairBuckets[a][b].clear();
+		}
+	}
+	physicsSimulationObject.pairsTested = tested + planeCollision();
+	emitOverlapEvents();
+}
 
-class physicsHalfspace : public physicsSimulation::physicsBody
+void applyContactImpulse(contact& c, Vector2 impulse)
 {
-private:
-	float rotation = 0;
-	Vector2 normal = { 0, -1 };
-public:
-	void setRotation(float rotationInDegrees)
+	c.a->velocity() -= impulse * inverseMass(c.a);
+	c.b->velocity() += impulse * inverseMass(c.b);
+}
+
+//Sequential impulses on the contacts found by collision(): non-penetration along the normal (no bounce)
+//and Coulomb friction along the tangent. With warm starting each contact begins from the impulses it
+//ended with last step, so stacks converge in far fewer iterations. Speculative contacts allow an approach
+//speed of up to separation / deltaTime, so the pair closes the gap this step but not more.
+void solveContacts()
+{
+	float inverseDeltaTime = 1 / physicsSimulationObject.deltaTime;
+	if (physicsSimulationObject.warmStarting)
 	{
-		rotation = rotationInDegrees;
-		normal = Vector2Rotate({ 0, -1 }, rotation * DEG2RAD);
+		for (int i = 0; i < contacts.size(); i++)
+		{
+			contact& c = contacts[i];
+			pairMap<cachedContact>::entry* cached = contactCacheObject.find(contactCacheObject.previous, c.key);
+			if (!cached)
+				continue;
+			c.normalImpulse = cached->value.normalImpulse;
+			c.tangentImpulse = cached->value.tangentImpulse;
+			Vector2 tangent = { -c.normal.y, c.normal.x };
+			applyContactImpulse(c, c.normal * c.normalImpulse + tangent * c.tangentImpulse);
+		}
 	}
 
-	float getRotation()
+	for (int iteration = 0; iteration < physicsSimulationObject.solverIterations; iteration++)
 	{
-		return rotation;
+		for (int i = 0; i < contacts.size(); i++)
+		{
+			contact& c = contacts[i];
+			Vector2 tangent = { -c.normal.y, c.normal.x };
+
+			Vector2 relativeVelocity = c.b->velocity() - c.a->velocity();
+			float lambda = -Vector2DotProduct(relativeVelocity, tangent) * c.normalMass;
+			float maxFriction = c.friction * c.normalImpulse;
+			float newImpulse = Clamp(c.tangentImpulse + lambda, -maxFriction, maxFriction);
+			applyContactImpulse(c, tangent * (newImpulse - c.tangentImpulse));
+			c.tangentImpulse = newImpulse;
+
+			relativeVelocity = c.b->velocity() - c.a->velocity();
+			lambda = -(Vector2DotProduct(relativeVelocity, c.normal) + c.separation * inverseDeltaTime) * c.normalMass;
+			newImpulse = fmaxf(c.normalImpulse + lambda, 0);
+			applyContactImpulse(c, c.normal * (newImpulse - c.normalImpulse));
+			c.normalImpulse = newImpulse;
+		}
 	}
-	Vector2 getNormal()
+
+	for (int i = 0; i < contacts.size(); i++)
 	{
-		return normal;
+		pairMap<cachedContact>::entry* slot = contactCacheObject.find(contactCacheObject.current, contacts[i].key);
+		slot->value.normalImpulse = contacts[i].normalImpulse;
+		slot->value.tangentImpulse = contacts[i].tangentImpulse;
 	}
-	void draw() override
-	{
-		DrawCircle(position.x, position.y, 8, color);
-		DrawLineEx(position, position + normal * 30, 1, color);
+}
 
-		Vector2 parallelToSurface = Vector2Rotate(normal, 90 * DEG2RAD);
-		DrawLineEx(position - parallelToSurface * 4000, position + parallelToSurface * 4000, 1, color);
+//Earliest time in [0, 1) at which two circles moving by motionA and motionB overlap by ccdSlop, or 1 if they don't
+float circleCircleTimeOfImpact(physicsCircle* circleA, Vector2 motionA, physicsCircle* circleB, Vector2 motionB)
+{
+	Vector2 separation = circleB->position() - circleA->position();
+	Vector2 motion = motionB - motionA;
+	float sumRadii = circleA->radius + circleB->radius - physicsSimulationObject.ccdSlop;
+
+	float a = Vector2DotProduct(motion, motion);
+	float b = 2 * Vector2DotProduct(separation, motion);
+	float c = Vector2DotProduct(separation, separation) - sumRadii * sumRadii;
+	//Already touching is the discrete contact's job, and moving apart can't hit
+	if (c <= 0 || b >= 0 || a == 0)
+		return 1;
+
+	float discriminant = b * b - 4 * a * c;
+	if (discriminant < 0)
+		return 1;
+	float t = (-b - sqrtf(discriminant)) / (2 * a);
+	return t < 1 ? t : 1;
+}
+
+std::vector<int> ccdStack;
+
+//Sweeps every circle that moves more than ccdMotionThreshold of its radius this step against the planes and
+//the other circles, and clamps its motion (and whatever it hits) to the first time of impact. Stopping just
+//inside the other shape means the discrete pass and solver take over next step, so nothing skips through.
+//Candidates for a fast circle come from the aabbTree rather than every body. The tree was synced before the
+//solver moved things, so the leaves are refitted again first, and the query box is the circle's swept box grown
+//by the furthest any circle moves this step, which covers every other body's swept box it could overlap.
+void continuousCollision()
+{
+	physicsSimulationObject.ccdHits = 0;
+	float dt = physicsSimulationObject.deltaTime;
+	syncTree();
+	moveTreeLeaves();
+	float furthest = 0;
+	physicsSimulation::bodyStore& circles = physicsSimulationObject.bodies[CIRCLE];
+	for (int i = 0; i < circles.size(); i++)
+	{
+		if (circles.invMass[i] != 0)
+			furthest = fmaxf(furthest, Vector2LengthSqr(circles.velocity[i]));
 	}
-	physicsShape Shape() override
+	furthest = sqrtf(furthest) * dt;
+
+	for (int i = 0; i < pObjects.size(); i++)
 	{
-		return HALFSPACE;
+		physicsSimulation::physicsBody* body = pObjects[i];
+		if (body->isStatic() || body->sensor || body->Shape() != CIRCLE)
+			continue;
+		physicsCircle* circle = (physicsCircle*)body;
+		Vector2 motion = circle->velocity() * dt;
+		float threshold = circle->radius * physicsSimulationObject.ccdMotionThreshold;
+		if (Vector2LengthSqr(motion) <= threshold * threshold)
+			continue;
+
+		float timeOfImpact = circle->timeOfImpact();
+		for (int p = 0; p < planes.offset.size(); p++)
+		{
+			if (!shouldCollide(circle, halfspaces[p]))
+				continue;
+			float distance = circle->position().x * planes.normalX[p] + circle->position().y * planes.normalY[p] - planes.offset[p] - circle->radius + physicsSimulationObject.ccdSlop;
+			float approach = motion.x * planes.normalX[p] + motion.y * planes.normalY[p];
+			if (distance >= 0 && approach < 0 && distance + approach < 0)
+				timeOfImpact = fminf(timeOfImpact, distance / -approach);
+		}
+
+		aabb sweep = sweptCircleBounds(circle, motion);
+		aabb reach = { sweep.min - Vector2{ furthest, furthest }, sweep.max + Vector2{ furthest, furthest } };
+		ccdStack.clear();
+		if (tree.root != -1)
+			ccdStack.push_back(tree.root);
+		while (!ccdStack.empty())
+		{
+			aabbTree::node& n = tree.nodes[ccdStack.back()];
+			ccdStack.pop_back();
+			if (!aabbOverlap(n.box, reach))
+				continue;
+			if (n.child1 != -1)
+			{
+				ccdStack.push_back(n.child1);
+				ccdStack.push_back(n.child2);
+				continue;
+			}
+			physicsCircle* other = n.circle;
+			if (other == circle || other->sensor || !shouldCollide(circle, other))
+				continue;
+			Vector2 otherMotion = other->isStatic() ? Vector2{ 0, 0 } : other->velocity() * dt;
+			if (!aabbOverlap(sweep, sweptCircleBounds(other, otherMotion)))
+				continue;
+
+			float t = circleCircleTimeOfImpact(circle, motion, other, otherMotion);
+			if (t < 1)
+			{
+				timeOfImpact = fminf(timeOfImpact, t);
+				other->timeOfImpact() = fminf(other->timeOfImpact(), t);
+			}
+		}
+
+		if (timeOfImpact < 1)
+			physicsSimulationObject.ccdHits++;
+		circle->timeOfImpact() = timeOfImpact;
 	}
+}
+
+struct rayHit
+{
+	physicsSimulation::physicsBody* body; //nullptr when nothing was hit
+	Vector2 point;
+	Vector2 normal;
+	float distance;
 };
 
-physicsSimulation physicsSimulationObject;
-physicsHalfspace halfspace;
-//physicsHalfspace halfspace2;
+//Queries see solid bodies in the mask's categories, sensors are never hit
+bool queryAccepts(physicsSimulation::physicsBody* body, unsigned int mask)
+{
+	return !body->sensor && (body->collisionCategory & mask);
+}
 
-std::vector<physicsSimulation::physicsBody*> pObjects;
+//Slab test, returns the distance at which the ray enters box or -1 if it misses within maxDistance
+float rayBoxEntry(aabb box, Vector2 origin, Vector2 inverseDirection, float maxDistance)
+{
+	float tx1 = (box.min.x - origin.x) * inverseDirection.x;
+	float tx2 = (box.max.x - origin.x) * inverseDirection.x;
+	float ty1 = (box.min.y - origin.y) * inverseDirection.y;
+	float ty2 = (box.max.y - origin.y) * inverseDirection.y;
+	float tEnter = fmaxf(fminf(tx1, tx2), fminf(ty1, ty2));
+	float tExit = fminf(fmaxf(tx1, tx2), fmaxf(ty1, ty2));
+	if (tExit < fmaxf(tEnter, 0) || tEnter > maxDistance)
+		return -1;
+	return fmaxf(tEnter, 0);
+}
 
-//bool circleCircleCollision(physicsCircle* circleA, physicsCircle* circleB)
-//{
-//	float sumRadii = circleA->radius + circleB->radius;
-//	Vector2 displacement = circleB->position - circleA->position;
-//
-//	float distance = Vector2Length(displacement);
-//
-//	return (distance < sumRadii) ? true : false;
-//}
+//Distance along a unit direction to a circle of the given radius, -1 on a miss. Like most engines, a
+//circle that already contains the origin is ignored so a probe can start inside a pile.
+float rayCircleDistance(Vector2 origin, Vector2 direction, Vector2 center, float radius)
+{
+	Vector2 m = origin - center;
+	float b = Vector2DotProduct(m, direction);
+	float c = Vector2DotProduct(m, m) - radius * radius;
+	if (c <= 0 || b > 0)
+		return -1;
+	float discriminant = b * b - c;
+	if (discriminant < 0)
+		return -1;
+	return -b - sqrtf(discriminant);
+}
 
-bool circleCircleCollisionResponse(physicsCircle* circleA, physicsCircle* circleB)
+std::vector<int> queryStack;
+
+//Sweeps a circle (radius 0 for a plain ray) from origin along direction and reports the first body it
+//would touch. Circles come from the tree, halfspaces are tested directly since there are only a few.
+bool circleCast(Vector2 origin, float radius, Vector2 direction, float maxDistance, rayHit& hit, unsigned int mask = 0xFFFFFFFF)
 {
-	float sumRadii = circleA->radius + circleB->radius;
-	Vector2 displacement = circleB->position - circleA->position;
+	syncTree();
+	direction = Vector2Normalize(direction);
+	Vector2 inverseDirection = { 1 / direction.x, 1 / direction.y };
+	hit.body = nullptr;
+	hit.distance = maxDistance;
 
-	float distance = Vector2Length(displacement);
-	float overlap = sumRadii - distance;
+	for (int p = 0; p < halfspaces.size(); p++)
+	{
+		if (!queryAccepts(halfspaces[p], mask))
+			continue;
+		Vector2 normal = halfspaces[p]->getNormal();
+		float gap = Vector2DotProduct(origin - halfspaces[p]->position(), normal) - radius;
+		float approach = Vector2DotProduct(direction, normal);
+		if (gap < 0 || approach >= 0 || gap / -approach >= hit.distance)
+			continue;
+		hit.body = halfspaces[p];
+		hit.distance = gap / -approach;
+		hit.normal = normal;
+		hit.point = origin + direction * hit.distance - normal * radius;
+	}
 
-	if (overlap > 0)
+	if (tree.root == -1)
+		return hit.body != nullptr;
+
+	Vector2 extent = { radius, radius };
+	queryStack.clear();
+	queryStack.push_back(tree.root);
+	while (!queryStack.empty())
 	{
-		Vector2 normalAtoB;
-		if (!distance)
-			normalAtoB = { 0, 1 };
-		else
-			normalAtoB = displacement / distance;
-		Vector2 mtv = normalAtoB * overlap; // Minimum translation vector (to push apart for collision)
-		circleA->position -= mtv * 0.5f;
-		circleB->position += mtv * 0.5f;
-		return true;
+		aabbTree::node& n = tree.nodes[queryStack.back()];
+		queryStack.pop_back();
+		if (rayBoxEntry({ n.box.min - extent, n.box.max + extent }, origin, inverseDirection, hit.distance) < 0)
+			continue;
+		if (n.child1 != -1)
+		{
+			queryStack.push_back(n.child1);
+			queryStack.push_back(n.child2);
+			continue;
+		}
+
+		physicsCircle* circle = n.circle;
+		if (!queryAccepts(circle, mask))
+			continue;
+		float t = rayCircleDistance(origin, direction, circle->position(), circle->radius + radius);
+		if (t < 0 || t >= hit.distance)
+			continue;
+		hit.body = circle;
+		hit.distance = t;
+		hit.normal = Vector2Normalize(origin + direction * t - circle->position());
+		hit.point = circle->position() + hit.normal * circle->radius;
 	}
-	else
-		return false;
+	return hit.body != nullptr;
 }
 
-//bool circleHalfspaceCollision(physicsCircle* circle, physicsHalfspace* halfspace)
-//{
-//	Vector2 displacementToCircle = circle->position - halfspace->position;
-//
-//	float dotProduct = Vector2DotProduct(displacementToCircle, halfspace->getNormal());
-//	Vector2 vectorProjection = halfspace->getNormal() * dotProduct;
-//	//float distance = Vector2Length(displacementToCircle);
-//
-//	DrawLineEx(circle->position, circle->position - vectorProjection, 1, GRAY);
-//
-//	Vector2 midpoint = circle->position - vectorProjection * 0.5f;
-//	DrawText(TextFormat("D: %3.0f", dotProduct), midpoint.x, midpoint.y, 30, LIGHTGRAY);
-//
-//	return dotProduct < circle->radius;
-//}
-
-bool circleHalfspaceCollisionResponse(physicsCircle* circle, physicsHalfspace* halfspace)
+bool raycast(Vector2 origin, Vector2 direction, float maxDistance, rayHit& hit, unsigned int mask = 0xFFFFFFFF)
 {
-	Vector2 displacementToCircle = circle->position - halfspace->position;
+	return circleCast(origin, 0, direction, maxDistance, hit, mask);
+}
 
-	float dotProduct = Vector2DotProduct(displacementToCircle, halfspace->getNormal());
-	Vector2 vectorProjection = halfspace->getNormal() * dotProduct;
-	//float distance = Vector2Length(displacementToCircle);
+//Ray packet in flat arrays. rayIndices holds, for every node waiting on the traversal stack, the subset of
+//rays that reached its parent, so deeper nodes only test the rays that can still hit them.
+struct rayPacket
+{
+	std::vector<Vector2> direction;
+	std::vector<float> inverseX;
+	std::vector<float> inverseY;
+	std::vector<float> best;
+	std::vector<int> rayIndices;
 
-	//DrawLineEx(circle->position, circle->position - vectorProjection, 1, GRAY);
+	struct pending
+	{
+		int node;
+		int first; //Range in rayIndices
+		int count;
+	};
+	std::vector<pending> stack;
+};
 
-	//Vector2 midpoint = circle->position - vectorProjection * 0.5f;
-	//DrawText(TextFormat("D: %3.0f", dotProduct), midpoint.x, midpoint.y, 30, LIGHTGRAY);
+rayPacket packet;
 
-	float overlap = circle->radius - dotProduct;
+//Traces count rays through the tree together: each node is visited once for the whole packet and the set
+//of live rays shrinks on the way down, so a coherent bundle such as a fan of aim probes shares most of the
+//traversal. Returns how many rays hit.
+int raycastPacket(const Vector2* origins, const Vector2* directions, int count, float maxDistance, rayHit* hits, unsigned int mask = 0xFFFFFFFF)
+{
+	syncTree();
+	packet.direction.resize(count);
+	packet.inverseX.resize(count);
+	packet.inverseY.resize(count);
+	packet.best.resize(count);
+	packet.rayIndices.clear();
+	packet.stack.clear();
+
+	for (int i = 0; i < count; i++)
+	{
+		Vector2 direction = Vector2Normalize(directions[i]);
+		packet.direction[i] = direction;
+		packet.inverseX[i] = 1 / direction.x;
+		packet.inverseY[i] = 1 / direction.y;
+		hits[i].body = nullptr;
+		hits[i].distance = maxDistance;
+
+		for (int p = 0; p < halfspaces.size(); p++)
+		{
+			if (!queryAccepts(halfspaces[p], mask))
+				continue;
+			Vector2 normal = halfspaces[p]->getNormal();
+			float gap = Vector2DotProduct(origins[i] - halfspaces[p]->position(), normal);
+			float approach = Vector2DotProduct(direction, normal);
+			if (gap < 0 || approach >= 0 || gap / -approach >= hits[i].distance)
+				continue;
+			hits[i].body = halfspaces[p];
+			hits[i].distance = gap / -approach;
+			hits[i].normal = normal;
+			hits[i].point = origins[i] + direction * hits[i].distance;
+		}
+		packet.best[i] = hits[i].distance;
+		packet.rayIndices.push_back(i);
+	}
 
-	if (overlap > 0)
+	if (tree.root != -1)
+		packet.stack.push_back({ tree.root, 0, count });
+	while (!packet.stack.empty())
 	{
-		Vector2 mtv = halfspace->getNormal() * overlap;
-		circle->position += mtv;
-		Vector2 Fgravity = physicsSimulationObject.gravAccel * circle->mass;
+		rayPacket::pending current = packet.stack.back();
+		packet.stack.pop_back();
+		aabbTree::node& n = tree.nodes[current.node];
+
+		//Narrow the parent's rays down to the ones that enter this node
+		int first = packet.rayIndices.size();
+		for (int k = 0; k < current.count; k++)
+		{
+			int i = packet.rayIndices[current.first + k];
+			float tx1 = (n.box.min.x - origins[i].x) * packet.inverseX[i];
+			float tx2 = (n.box.max.x - origins[i].x) * packet.inverseX[i];
+			float ty1 = (n.box.min.y - origins[i].y) * packet.inverseY[i];
+			float ty2 = (n.box.max.y - origins[i].y) * packet.inverseY[i];
+			float tEnter = fmaxf(fminf(tx1, tx2), fminf(ty1, ty2));
+			float tExit = fminf(fmaxf(tx1, tx2), fmaxf(ty1, ty2));
+			if (tExit >= fmaxf(tEnter, 0) && tEnter <= packet.best[i])
+				packet.rayIndices.push_back(i);
+		}
+		int live = packet.rayIndices.size() - first;
+		if (live == 0)
+			continue;
 
-		Vector2 FgPerp = halfspace->getNormal() * Vector2DotProduct(Fgravity, halfspace->getNormal());
-		Vector2 Fnormal = FgPerp * -1;
-		circle->netForce += Fnormal;
-		DrawLineEx(circle->position, circle->position + Fnormal, 1, GREEN);
+		if (n.child1 != -1)
+		{
+			packet.stack.push_back({ n.child1, first, live });
+			packet.stack.push_back({ n.child2, first, live });
+			continue;
+		}
 
-		float u = circle->coefficientOfFriction;
-		float frictionMagnitude = u * Vector2Length(Fnormal);
+		physicsCircle* circle = n.circle;
+		if (!queryAccepts(circle, mask))
+			continue;
+		for (int k = 0; k < live; k++)
+		{
+			int i = packet.rayIndices[first + k];
+			float t = rayCircleDistance(origins[i], packet.direction[i], circle->position(), circle->radius);
+			if (t < 0 || t >= packet.best[i])
+				continue;
+			packet.best[i] = t;
+			hits[i].body = circle;
+			hits[i].distance = t;
+			hits[i].point = origins[i] + packet.direction[i] * t;
+			hits[i].normal = Vector2Normalize(hits[i].point - circle->position());
+		}
+	}
 
-		Vector2 FgPara = Fgravity - FgPerp;
-		Vector2 frictionDir = Vector2Normalize(FgPara) * -1;
+	int hitCount = 0;
+	for (int i = 0; i < count; i++)
+		hitCount += hits[i].body != nullptr;
+	return hitCount;
+}
 
-		Vector2 Ffriction = frictionDir * frictionMagnitude;
+bool circleOverlapsBox(physicsCircle* circle, aabb box)
+{
+	Vector2 closest = Vector2Clamp(circle->position(), box.min, box.max);
+	return Vector2DistanceSqr(closest, circle->position()) <= circle->radius * circle->radius;
+}
 
-		circle->netForce += Ffriction;
-		DrawLineEx(circle->position, circle->position + Ffriction, 1, ORANGE);
+//Region query results are written either as body pointers, only valid until the next removal, or as handles
+//for anything that keeps them longer and resolves them at the point of use
+inline void storeQueryResult(physicsSimulation::physicsBody*& slot, physicsSimulation::physicsBody* body)
+{
+	slot = body;
+}
 
-		return true;
-	}
-	else
-	{
-		return false;
-	}
+inline void storeQueryResult(physicsSimulation::bodyHandle& slot, physicsSimulation::physicsBody* body)
+{
+	slot = body->handle;
 }
 
-void collision()
+//Shared walk for the region queries: collects accepted bodies that pass the test for their shape into results,
+//stopping once capacity is reached. Returns how many were written.
+template <typename Result, typename CircleTest, typename HalfspaceTest>
+int queryRegion(aabb bounds, CircleTest circleOverlaps, HalfspaceTest halfspaceOverlaps, Result* results, int capacity, unsigned int mask)
 {
-	for (int i = 0; i < pObjects.size(); i++)
+	syncTree();
+	int found = 0;
+	for (int p = 0; p < halfspaces.size() && found < capacity; p++)
 	{
-		//pObjects[i]->color = GREEN;
+		if (queryAccepts(halfspaces[p], mask) && halfspaceOverlaps(halfspaces[p]))
+			storeQueryResult(results[found++], halfspaces[p]);
 	}
-	for (int i = 0; i < pObjects.size(); i++)
+
+	if (tree.root == -1)
+		return found;
+	queryStack.clear();
+	queryStack.push_back(tree.root);
+	while (!queryStack.empty() && found < capacity)
 	{
-		for (int j = 0; j < pObjects.size(); j++)
+		aabbTree::node& n = tree.nodes[queryStack.back()];
+		queryStack.pop_back();
+		if (!aabbOverlap(n.box, bounds))
+			continue;
+		if (n.child1 != -1)
 		{
-			if (i != j)
-			{
-				physicsSimulation::physicsBody* objectA = pObjects[i];
-				physicsSimulation::physicsBody* objectB = pObjects[j];
-
-				physicsShape shapeA = objectA->Shape();
-				physicsShape shapeB = objectB->Shape();
-
-				bool didOverlap = false;
+			queryStack.push_back(n.child1);
+			queryStack.push_back(n.child2);
+		}
+		else if (queryAccepts(n.circle, mask) && circleOverlaps(n.circle))
+			storeQueryResult(results[found++], n.circle);
+	}
+	return found;
+}
 
-				if (shapeA == CIRCLE && shapeB == CIRCLE)
-					didOverlap = circleCircleCollisionResponse((physicsCircle*)objectA, (physicsCircle*)objectB);
+//Bodies containing point, for picking
+template <typename Result>
+int queryPoint(Vector2 point, Result* results, int capacity, unsigned int mask = 0xFFFFFFFF)
+{
+	return queryRegion({ point, point },
+		[&](physicsCircle* circle) { return Vector2DistanceSqr(circle->position(), point) <= circle->radius * circle->radius; },
+		[&](physicsHalfspace* halfspace) { return Vector2DotProduct(point - halfspace->position(), halfspace->getNormal()) <= 0; },
+		results, capacity, mask);
+}
 
-				else if (shapeA == CIRCLE && shapeB == HALFSPACE)
-					didOverlap = circleHalfspaceCollisionResponse((physicsCircle*)objectA, (physicsHalfspace*)objectB);
+template <typename Result>
+int queryAABB(aabb box, Result* results, int capacity, unsigned int mask = 0xFFFFFFFF)
+{
+	return queryRegion(box,
+		[&](physicsCircle* circle) { return circleOverlapsBox(circle, box); },
+		[&](physicsHalfspace* halfspace)
+		{
+			//The corner furthest behind the plane decides it
+			Vector2 normal = halfspace->getNormal();
+			Vector2 corner = { normal.x > 0 ? box.min.x : box.max.x, normal.y > 0 ? box.min.y : box.max.y };
+			return Vector2DotProduct(corner - halfspace->position(), normal) <= 0;
+		},
+		results, capacity, mask);
+}
 
-				else if (shapeB == CIRCLE && shapeA == HALFSPACE)
-					didOverlap = circleHalfspaceCollisionResponse((physicsCircle*)objectB, (physicsHalfspace*)objectA);
+template <typename Result>
+int queryCircle(Vector2 center, float radius, Result* results, int capacity, unsigned int mask = 0xFFFFFFFF)
+{
+	Vector2 extent = { radius, radius };
+	return queryRegion({ center - extent, center + extent },
+		[&](physicsCircle* circle)
+		{
+			float sumRadii = circle->radius + radius;
+			return Vector2DistanceSqr(circle->position(), center) <= sumRadii * sumRadii;
+		},
+		[&](physicsHalfspace* halfspace) { return Vector2DotProduct(center - halfspace->position(), halfspace->getNormal()) <= radius; },
+		results, capacity, mask);
+}
 
-				if (didOverlap)
-				{
-					//objectA->color = RED;
-					//objectB->color = RED;
-				}
+//Sensors stay out of the broadphase pairs, each one is resolved with a single tree query instead. Like the
+//queries, only solid bodies are reported, so sensors don't see each other.
+void findSensorOverlaps()
+{
+	physicsSimulation::physicsBody** found = nullptr;
+	for (int i = 0; i < pObjects.size(); i++)
+	{
+		if (!pObjects[i]->sensor || pObjects[i]->Shape() != CIRCLE)
+			continue;
+		if (!found)
+			found = physicsSimulationObject.arena.allocate<physicsSimulation::physicsBody*>(pObjects.size());
+		physicsCircle* sensor = (physicsCircle*)pObjects[i];
+		int count = queryCircle(sensor->position(), sensor->radius, found, pObjects.size());
+		int tested = 0;
+		int hits = 0;
+		for (int j = 0; j < count; j++)
+		{
+			if (found[j]->Shape() != CIRCLE)
+				continue;
+			if (!shouldCollide(sensor, found[j]))
+			{
+				physicsSimulationObject.pairsFiltered++;
+				continue;
 			}
+			tested++;
+			hits += sensorTest(sensor, found[j]);
 		}
+		collisionStats.record(CIRCLE, CIRCLE, tested, hits);
 	}
 }
 
@@ -256,24 +3419,21 @@ void deletion()
 {
 	for (int i = 0; i < pObjects.size(); i++)
 	{
-		if (pObjects[i]->position.y > GetScreenHeight()
-			|| pObjects[i]->position.y < 0
-			|| pObjects[i]->position.x > GetScreenWidth()
-			|| pObjects[i]->position.x < 0)
-		{
-			physicsSimulation::physicsBody* deleteThis = *(pObjects.begin() + i);
-			delete deleteThis;
-			pObjects.erase(pObjects.begin() + i);
-			i--;
-		}
+		if (pObjects[i]->position().y > GetScreenHeight()
+			|| pObjects[i]->position().y < 0
+			|| pObjects[i]->position().x > GetScreenWidth()
+			|| pObjects[i]->position().x < 0)
+			removeBody(pObjects[i]);
 	}
+	flushRemovals();
 }
 
 void resetNetForces()
 {
-	for (int i = 0; i < pObjects.size(); i++)
+	for (int shape = 0; shape < SHAPE_COUNT; shape++)
 	{
-		pObjects[i]->netForce = { 0, 0 };
+		physicsSimulation::bodyStore& store = physicsSimulationObject.bodies[shape];
+		std::fill(store.netForce.begin(), store.netForce.end(), Vector2{ 0, 0 });
 	}
 }
 
@@ -281,49 +3441,191 @@ void addGravForces()
 {
 	
 	//physicsSimulationObject.gravity = { gravMag * (float)cos(gravDir * DEG2RAD), -gravMag * (float)sin(gravDir * DEG2RAD) };
-	for (int i = 0; i < pObjects.size(); i++)
+	Vector2 gravAccel = physicsSimulationObject.gravAccel;
+	for (int shape = 0; shape < SHAPE_COUNT; shape++)
 	{
-		if (!pObjects[i]->staticBody)
+		physicsSimulation::bodyStore& store = physicsSimulationObject.bodies[shape];
+		Vector2* netForce = store.netForce.data();
+		const float* mass = store.mass.data();
+		const float* invMass = store.invMass.data();
+		for (int i = 0; i < store.size(); i++)
 		{
-
-			//pObjects[i]->position += pObjects[i]->velocity * physicsSimulationObject.deltaTime;
-			//pObjects[i]->velocity += physicsSimulationObject.gravity * physicsSimulationObject.deltaTime;
-			Vector2 FGravity = physicsSimulationObject.gravAccel * pObjects[i]->mass;
-			pObjects[i]->netForce += FGravity;
+			//Static bodies have no inverse mass and get no weight
+			float weight = invMass[i] > 0 ? mass[i] : 0;
+			netForce[i].x += gravAccel.x * weight;
+			netForce[i].y += gravAccel.y * weight;
 		}
 	}
 }
 
+//Walks the stores rather than pObjects so the loop reads contiguous arrays. Static bodies have no inverse
+//mass, which also stops them moving.
 void applyKinematics()
 {
-	for (int i = 0; i < pObjects.size(); i++)
+	float dt = physicsSimulationObject.deltaTime;
+	for (int shape = 0; shape < SHAPE_COUNT; shape++)
+	{
+		physicsSimulation::bodyStore& store = physicsSimulationObject.bodies[shape];
+		Vector2* position = store.position.data();
+		Vector2* velocity = store.velocity.data();
+		const Vector2* netForce = store.netForce.data();
+		const float* invMass = store.invMass.data();
+		float* timeOfImpact = store.timeOfImpact.data();
+		for (int i = 0; i < store.size(); i++)
+		{
+			float moves = invMass[i] > 0 ? 1.0f : 0.0f;
+			float step = dt * timeOfImpact[i] * moves;
+			position[i].x += velocity[i].x * step;
+			position[i].y += velocity[i].y * step;
+			timeOfImpact[i] = 1;
+			velocity[i].x += netForce[i].x * invMass[i] * dt;
+			velocity[i].y += netForce[i].y * invMass[i] * dt;
+		}
+	}
+}
+
+//Every interval steps sorts pObjects, and the body stores after it, along a Z-order curve of the positions.
+//Spawning and deletion scatter neighbours across memory over time; after a pass the grid cells, pair lists and
+//store slots of nearby bodies sit next to each other again. The mean step time over sampleSteps before and
+//after each pass is kept so the cost of the pass can be weighed against what it saves.
+class mortonReorder
+{
+public:
+	bool enabled = false;
+	int interval = 300;
+	int sampleSteps = 10;
+	float reorderTime = 0; //milliseconds spent in the last pass
+	float stepTimeBefore = 0; //mean milliseconds per step before the last pass
+	float stepTimeAfter = 0; //and after it, 0 until sampleSteps have run
+	int passes = 0;
+
+	void step(float stepTime)
 	{
-		if (!pObjects[i]->staticBody)
+		if (!enabled)
+		{
+			stepsSincePass = 0;
+			timeBefore = 0;
+			timeAfter = 0;
+			return;
+		}
+		stepsSincePass++;
+		if (passes > 0 && stepsSincePass <= sampleSteps)
 		{
+			timeAfter += stepTime;
+			if (stepsSincePass == sampleSteps)
+				stepTimeAfter = timeAfter / sampleSteps;
+		}
+		if (stepsSincePass > interval - sampleSteps)
+			timeBefore += stepTime;
+		if (stepsSincePass < interval)
+			return;
+
+		stepTimeBefore = timeBefore / sampleSteps;
+		stepTimeAfter = 0;
+		double start = GetTime();
+		reorder(pObjects);
+		reorderTime = (float)((GetTime() - start) * 1000.0);
+		passes++;
+		stepsSincePass = 0;
+		timeBefore = 0;
+		timeAfter = 0;
+	}
 
-			//pObjects[i]->position += pObjects[i]->velocity * physicsSimulationObject.deltaTime;
-			//pObjects[i]->velocity += physicsSimulationObject.gravity * physicsSimulationObject.deltaTime;
-			//Vector2 FGravity = physicsSimulationObject.gravAccel * pObjects[i]->mass;
-			//pObjects[i]->netForce += FGravity;
-			pObjects[i]->position += pObjects[i]->velocity * physicsSimulationObject.deltaTime;
+	void reorder(std::vector<physicsSimulation::physicsBody*>& bodies)
+	{
+		int count = bodies.size();
+		if (count < 2)
+			return;
+
+		//Quantise to 16 bits per axis over the bounds of the bodies and interleave into a 32 bit key
+		Vector2 lower = bodies[0]->position();
+		Vector2 upper = lower;
+		for (int i = 1; i < count; i++)
+		{
+			lower = Vector2Min(lower, bodies[i]->position());
+			upper = Vector2Max(upper, bodies[i]->position());
+		}
+		float extent = fmaxf(fmaxf(upper.x - lower.x, upper.y - lower.y), 1.0f);
+		float scale = 65535.0f / extent;
+		physicsSimulation::frameArena& arena = physicsSimulationObject.arena;
+		unsigned int* keys = arena.allocate<unsigned int>(count);
+		int* order = arena.allocate<int>(count);
+		for (int i = 0; i < count; i++)
+		{
+			Vector2 cell = (bodies[i]->position() - lower) * scale;
+			keys[i] = spreadBits((unsigned int)cell.x) | (spreadBits((unsigned int)cell.y) << 1);
+			order[i] = i;
+		}
 
-			Vector2 acceleration = pObjects[i]->netForce / pObjects[i]->mass;
-			
-			pObjects[i]->velocity += acceleration * physicsSimulationObject.deltaTime;
-			//DrawLineEx(pObjects[i]->position, pObjects[i]->position + pObjects[i]->netForce, 1, GRAY);
-			DrawLineEx(pObjects[i]->position, pObjects[i]->position + (physicsSimulationObject.gravAccel * pObjects[i]->mass), 1, PURPLE);
+		//LSD radix sort, one byte per pass. Stable, so bodies with equal keys keep their relative order.
+		unsigned int* keyScratch = arena.allocate<unsigned int>(count);
+		int* orderScratch = arena.allocate<int>(count);
+		for (int shift = 0; shift < 32; shift += 8)
+		{
+			int offsets[257] = {};
+			for (int i = 0; i < count; i++)
+				offsets[((keys[i] >> shift) & 0xFF) + 1]++;
+			for (int digit = 0; digit < 256; digit++)
+				offsets[digit + 1] += offsets[digit];
+			for (int i = 0; i < count; i++)
+			{
+				int target = offsets[(keys[i] >> shift) & 0xFF]++;
+				keyScratch[target] = keys[i];
+				orderScratch[target] = order[i];
+			}
+			std::swap(keys, keyScratch);
+			std::swap(order, orderScratch);
 		}
+
+		sorted.resize(count);
+		for (int i = 0; i < count; i++)
+			sorted[i] = bodies[order[i]];
+		bodies.swap(sorted);
+		for (int shape = 0; shape < SHAPE_COUNT; shape++)
+			physicsSimulationObject.bodies[shape].arrange(bodies);
+		neighbors.dirty = true; //Rebuild the stored pairs in the new order
 	}
-}
+
+private:
+	int stepsSincePass = 0;
+	float timeBefore = 0;
+	float timeAfter = 0;
+	std::vector<physicsSimulation::physicsBody*> sorted;
+
+	//Puts the low 16 bits of value in the even bit positions
+	static unsigned int spreadBits(unsigned int value)
+	{
+		value &= 0xFFFF;
+		value = (value | (value << 8)) & 0x00FF00FF;
+		value = (value | (value << 4)) & 0x0F0F0F0F;
+		value = (value | (value << 2)) & 0x33333333;
+		value = (value | (value << 1)) & 0x55555555;
+		return value;
+	}
+};
+
+mortonReorder bodyOrder;
 
 //Changes world state
 void update()
 {
+	physicsSimulationObject.arena.reset();
 	physicsSimulationObject.time += physicsSimulationObject.deltaTime;
 	//vel = change in position / time, therefore change in position = vel * time
 	resetNetForces();
 	addGravForces();
+	double collisionStart = GetTime();
 	collision();
+	physicsSimulationObject.collisionTime = (float)((GetTime() - collisionStart) * 1000.0);
+	double solverStart = GetTime();
+	solveContacts();
+	physicsSimulationObject.solverTime = (float)((GetTime() - solverStart) * 1000.0);
+	if (physicsSimulationObject.continuousCollision == CCD_SWEPT)
+	{
+		double ccdStart = GetTime();
+		continuousCollision();
+		physicsSimulationObject.ccdTime = (float)((GetTime() - ccdStart) * 1000.0);
+	}
 	applyKinematics();
 
 	//accel = deltaV / time (change in velocity over time) therefore deltaV = accel * time
@@ -332,6 +3634,50 @@ void update()
 	if (IsMouseButtonPressed(MOUSE_BUTTON_RIGHT))
         launchPosition = GetMousePosition();
 
+	//Left click picks up the body under the cursor and drags (or throws) it
+	if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT))
+	{
+		physicsSimulation::bodyHandle underMouse[8];
+		int found = queryPoint(GetMousePosition(), underMouse, 8);
+		for (int i = 0; i < found; i++)
+		{
+			physicsSimulation::physicsBody* body = physicsSimulationObject.handles.resolve(underMouse[i]);
+			if (body && !body->isStatic())
+				pickedBody = underMouse[i];
+		}
+	}
+	if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT))
+		pickedBody = {};
+	//Resolves to nullptr once the body has left the screen and been removed
+	if (physicsSimulation::physicsBody* picked = physicsSimulationObject.handles.resolve(pickedBody))
+	{
+		Vector2 mouse = GetMousePosition();
+		picked->velocity() = (mouse - picked->position()) / physicsSimulationObject.deltaTime;
+		picked->disturbedStep = physicsSimulationObject.stepCount;
+		picked->position() = mouse;
+	}
+
+	//E blasts everything near the cursor outwards, weaker towards the edge of the radius
+	if (IsKeyPressed(KEY_E))
+	{
+		const float blastRadius = 150;
+		const float blastImpulse = 800;
+		static physicsSimulation::bodyHandle blasted[4096];
+		Vector2 mouse = GetMousePosition();
+		int found = queryCircle(mouse, blastRadius, blasted, 4096);
+		for (int i = 0; i < found; i++)
+		{
+			physicsSimulation::physicsBody* body = physicsSimulationObject.handles.resolve(blasted[i]);
+			if (!body || body->isStatic())
+				continue;
+			Vector2 offset = body->position() - mouse;
+			float distance = Vector2Length(offset);
+			Vector2 direction = distance > 0 ? offset / distance : Vector2{ 0, -1 };
+			body->velocity() += direction * (blastImpulse * (1 - fminf(distance / blastRadius, 1)) / body->getMass());
+			body->disturbedStep = physicsSimulationObject.stepCount;
+		}
+	}
+
 	if (IsKeyPressed(KEY_SPACE))
 	{
 		Vector2 velocity = {launchSpeed * (float)cos(launchAngle * DEG2RAD), -launchSpeed * (float)sin(launchAngle * DEG2RAD)};
@@ -367,10 +3713,40 @@ void update()
 			break;
 		}
 		physicsCircle* newCircle = new physicsCircle(launchPosition, velocity, newRadius, newFric, newMass, newColor);
-		pObjects.push_back(newCircle);
+		addBody(newCircle);
+	}
+
+	if (IsKeyPressed(KEY_H))
+	{
+		collisionStats.heatmap = !collisionStats.heatmap;
+		collisionStats.occupancy = collisionStats.occupancy || collisionStats.heatmap;
+	}
+
+	//Debris only collides with the ground, never with balls or other debris
+	if (IsKeyPressed(KEY_D))
+	{
+		Vector2 velocity = { launchSpeed * (float)cos(launchAngle * DEG2RAD), -launchSpeed * (float)sin(launchAngle * DEG2RAD) };
+		physicsCircle* debris = new physicsCircle(launchPosition, velocity, 5, 0.5f, 1, GRAY);
+		debris->collisionCategory = LAYER_DEBRIS;
+		debris->collisionMask = LAYER_GROUND;
+		addBody(debris);
 	}
 	
 	deletion();
+	float stepTime = physicsSimulationObject.collisionTime + physicsSimulationObject.solverTime;
+	if (physicsSimulationObject.continuousCollision == CCD_SWEPT)
+		stepTime += physicsSimulationObject.ccdTime;
+	bodyOrder.step(stepTime);
+	physicsSimulationObject.stepCount++;
+
+	//Drain this step's sensor events
+	overlapEvent event;
+	physicsSimulation::physicsBody* zone = physicsSimulationObject.handles.resolve(triggerZone);
+	while (overlapEvents.pop(event))
+	{
+		if (event.begin && zone && event.sensorId == zone->id)
+			triggerCount++;
+	}
 }
 
 //Display world state
@@ -378,8 +3754,12 @@ void draw()
 {
 	BeginDrawing();
 	ClearBackground(BLACK);
+	//Drawn first so bodies and the GUI stay visible on top
+	if (collisionStats.heatmap && collisionStats.occupancy)
+		collisionStats.drawHeatmap();
 	DrawText("Michael McKall 101551503", 10, float(GetScreenHeight() - 30), 20, LIGHTGRAY);
 	DrawText(TextFormat("Change launchPosition by right clicking. launchPosition: {%08f, %08f}", launchPosition.x, launchPosition.y), 10, 5, 20, LIGHTGRAY);
+	DrawText("SPACE launches a ball, D launches debris, hold A for aim probes, left drag picks, E explodes, H heatmap", 10, float(GetScreenHeight() - 55), 20, LIGHTGRAY);
 
 	GuiSliderBar(Rectangle{ 10, 40, 1000, 20 }, "", TextFormat("%.2f", physicsSimulationObject.time), &physicsSimulationObject.time, 0, 240);
 
@@ -393,21 +3773,97 @@ void draw()
 
 	GuiSliderBar(Rectangle{ 10, 160, 500, 30 }, "Gravity Magnitude", TextFormat("Magnitude: %.0f", physicsSimulationObject.gravAccel.y), &physicsSimulationObject.gravAccel.y, -1000, 1000);
 
-	GuiSliderBar(Rectangle{ 10, 240, 500, 30 }, "Halfspace X", TextFormat("Halfspace X: %.0f", halfspace.position.x), &halfspace.position.x, 0, GetScreenWidth());
+	GuiSliderBar(Rectangle{ 10, 240, 500, 30 }, "Halfspace X", TextFormat("Halfspace X: %.0f", halfspace.position().x), &halfspace.position().x, 0, GetScreenWidth());
 
-	GuiSliderBar(Rectangle{ 10, 280, 500, 30 }, "Halfspace Y", TextFormat("Halfspace Y: %.0f", halfspace.position.y), &halfspace.position.y, 0, GetScreenHeight());
+	GuiSliderBar(Rectangle{ 10, 280, 500, 30 }, "Halfspace Y", TextFormat("Halfspace Y: %.0f", halfspace.position().y), &halfspace.position().y, 0, GetScreenHeight());
 
 	float halfspaceRotation = halfspace.getRotation();
 	GuiSliderBar(Rectangle{ 10, 320, 500, 30 }, "Halfspace Rot", TextFormat("Halfspace Rot: %.0f Degrees", halfspace.getRotation()), &halfspaceRotation, -360, 360);
 	halfspace.setRotation(halfspaceRotation);
 
+	GuiToggleGroup(Rectangle{ 10, 360, 120, 30 }, "BRUTE FORCE;GRID;SWEEP AND PRUNE;AABB TREE;NEIGHBOR LIST", &physicsSimulationObject.broadphase);
+	GuiCheckBox(Rectangle{ 640, 365, 20, 20 }, TextFormat("Parallel (%i threads)", (int)workers.threads.size() + 1), &physicsSimulationObject.parallelBroadphase);
+	GuiCheckBox(Rectangle{ 850, 365, 20, 20 }, "Auto", &broadphaseSelection.enabled);
+	if (broadphaseSelection.enabled)
+		DrawText(TextFormat("Auto: radius CV %.2f, %.1f per cell, %.0f%% yield, %i switches", broadphaseSelection.radiusVariation, broadphaseSelection.bodiesPerCell, broadphaseSelection.pairYield * 100, broadphaseSelection.switches), 10, 555, 20, LIGHTGRAY);
+	DrawText(TextFormat("Frame arena: %i KB used, %i KB peak, %i KB reserved", (int)(physicsSimulationObject.arena.used() / 1024), (int)(physicsSimulationObject.arena.highWater / 1024), (int)(physicsSimulationObject.arena.capacity() / 1024)), 10, 580, 20, LIGHTGRAY);
+
+	float solverIterations = physicsSimulationObject.solverIterations;
+	GuiSliderBar(Rectangle{ 10, 400, 500, 30 }, "Iterations", TextFormat("Solver Iterations: %i", physicsSimulationObject.solverIterations), &solverIterations, 1, 20);
+	physicsSimulationObject.solverIterations = (int)solverIterations;
+	GuiCheckBox(Rectangle{ 520, 405, 20, 20 }, "Warm Start", &physicsSimulationObject.warmStarting);
+
+	GuiToggleGroup(Rectangle{ 10, 440, 120, 30 }, "NO CCD;SWEPT CCD;SPECULATIVE", &physicsSimulationObject.continuousCollision);
+	GuiCheckBox(Rectangle{ 390, 445, 20, 20 }, "Skip Distant Pairs", &physicsSimulationObject.pairScheduling);
+
+	//Greyed out while the selection would have no effect, see batchedNarrowphaseActive()
+	if (physicsSimulationObject.continuousCollision == CCD_SPECULATIVE || physicsSimulationObject.broadphase == BRUTE_FORCE)
+		GuiDisable();
+	GuiToggleGroup(Rectangle{ 10, 480, 120, 30 }, "SEQUENTIAL;BATCHED SCALAR;BATCHED SIMD", &physicsSimulationObject.narrowphase);
+	GuiEnable();
+	GuiCheckBox(Rectangle{ 10, 525, 20, 20 }, "Occupancy", &collisionStats.occupancy);
+	GuiCheckBox(Rectangle{ 130, 525, 20, 20 }, "Heatmap (H)", &collisionStats.heatmap);
+	GuiCheckBox(Rectangle{ 260, 525, 20, 20 }, "Morton Reorder", &bodyOrder.enabled);
+	if (!batchedNarrowphaseActive() || physicsSimulationObject.narrowphase != NARROWPHASE_SIMD)
+		GuiDisable();
+	GuiCheckBox(Rectangle{ 390, 485, 20, 20 }, "Verify vs Scalar", &physicsSimulationObject.verifyNarrowphase);
+	GuiEnable();
+
 	DrawText(TextFormat("Object Count: %i", pObjects.size()), GetScreenWidth() - 300, 100, 30, LIGHTGRAY);
+	DrawText(TextFormat("Circle pool: %i / %i", circlePool.liveCount(), circlePool.capacity()), GetScreenWidth() - 300, 75, 20, LIGHTGRAY);
+	if (bodyOrder.enabled && bodyOrder.passes > 0)
+		DrawText(TextFormat("Reorder %.2f ms, step %.2f -> %.2f ms", bodyOrder.reorderTime, bodyOrder.stepTimeBefore, bodyOrder.stepTimeAfter), GetScreenWidth() - 300, 50, 20, LIGHTGRAY);
+	DrawText(TextFormat("Collision: %.3f ms", physicsSimulationObject.collisionTime), GetScreenWidth() - 300, 140, 20, LIGHTGRAY);
+	DrawText(TextFormat("Pairs tested: %i (%i filtered, %i skipped)", physicsSimulationObject.pairsTested, physicsSimulationObject.pairsFiltered, physicsSimulationObject.pairsSkipped), GetScreenWidth() - 300, 165, 20, LIGHTGRAY);
+	DrawText(TextFormat("Solver: %.3f ms, %i contacts", physicsSimulationObject.solverTime, contacts.size()), GetScreenWidth() - 300, 215, 20, LIGHTGRAY);
+	if (physicsSimulationObject.continuousCollision == CCD_SWEPT)
+		DrawText(TextFormat("CCD: %.3f ms, %i hits", physicsSimulationObject.ccdTime, physicsSimulationObject.ccdHits), GetScreenWidth() - 300, 240, 20, LIGHTGRAY);
+	else if (physicsSimulationObject.continuousCollision == CCD_SPECULATIVE)
+		DrawText(TextFormat("Speculative contacts: %i", physicsSimulationObject.speculativeContacts), GetScreenWidth() - 300, 240, 20, LIGHTGRAY);
+	if (batchedNarrowphaseActive())
+	{
+		if (physicsSimulationObject.verifyNarrowphase && physicsSimulationObject.narrowphase == NARROWPHASE_SIMD)
+			DrawText(TextFormat("Narrowphase: %.3f ms, %i mismatches", physicsSimulationObject.narrowphaseTime, physicsSimulationObject.narrowphaseMismatches), GetScreenWidth() - 300, 265, 20, LIGHTGRAY);
+		else
+			DrawText(TextFormat("Narrowphase: %.3f ms", physicsSimulationObject.narrowphaseTime), GetScreenWidth() - 300, 265, 20, LIGHTGRAY);
+	}
+	if (physicsSimulationObject.broadphase == AABB_TREE)
+		DrawText(TextFormat("Tree cost: %.2fx, %i rebuilds", treePolicy.baselineCost > 0 ? treePolicy.currentCost / treePolicy.baselineCost : 1.0f, treePolicy.fullRebuilds), GetScreenWidth() - 300, 190, 20, LIGHTGRAY);
+	if (physicsSimulationObject.broadphase == NEIGHBOR_LIST)
+		DrawText(TextFormat("Neighbor list age: %i steps", neighbors.stepsSinceBuild), GetScreenWidth() - 300, 190, 20, LIGHTGRAY);
 	DrawText(TextFormat("T: %6.2f", physicsSimulationObject.time), GetScreenWidth() - 140, 10, 30, LIGHTGRAY);
+	collisionStats.drawOverlay(GetScreenWidth() - 450, 290);
 
 	//Vector2 startPos = { 100, GetScreenHeight() - 100 };
 	Vector2 velocity = { launchSpeed * cos(launchAngle * DEG2RAD), -launchSpeed * sin(launchAngle * DEG2RAD)};
 
 	DrawLineEx(launchPosition, launchPosition + velocity, 3, RED);
+
+	//Where a ball launched now would first touch something, ignoring gravity
+	rayHit aimHit;
+	if (launchSpeed != 0 && circleCast(launchPosition, 15, velocity, 4000, aimHit))
+	{
+		Vector2 aimCenter = launchPosition + Vector2Normalize(velocity) * aimHit.distance;
+		DrawCircleLines(aimCenter.x, aimCenter.y, 15, ORANGE);
+	}
+
+	//Hold A to trace a fan of aim probes as one packet
+	if (IsKeyDown(KEY_A))
+	{
+		const int probeCount = 128;
+		Vector2 probeOrigins[probeCount];
+		Vector2 probeDirections[probeCount];
+		rayHit probeHits[probeCount];
+		for (int i = 0; i < probeCount; i++)
+		{
+			float angle = (launchAngle - 45 + 90.0f * i / (probeCount - 1)) * DEG2RAD;
+			probeOrigins[i] = launchPosition;
+			probeDirections[i] = { cosf(angle), -sinf(angle) };
+		}
+		raycastPacket(probeOrigins, probeDirections, probeCount, 4000, probeHits);
+		for (int i = 0; i < probeCount; i++)
+			DrawLineEx(launchPosition, launchPosition + probeDirections[i] * probeHits[i].distance, 1, Fade(ORANGE, 0.3f));
+	}
 	for (int i = 0; i < pObjects.size(); i++)
 	{
 		/*float mass = 1;
@@ -422,9 +3878,14 @@ void draw()
 		
 		pObjects[i]->velocity += Ffriction;*/
 
+		if (!pObjects[i]->isStatic())
+			DrawLineEx(pObjects[i]->position(), pObjects[i]->position() + (physicsSimulationObject.gravAccel * pObjects[i]->getMass()), 1, PURPLE);
 		pObjects[i]->draw();
 	}
 
+	if (physicsSimulation::physicsBody* zone = physicsSimulationObject.handles.resolve(triggerZone))
+		DrawText(TextFormat("Entered: %i", triggerCount), zone->position().x - 40, zone->position().y - 10, 20, SKYBLUE);
+
 	EndDrawing();
 }
 
@@ -432,15 +3893,23 @@ int main()
 {
 	InitWindow(InitialWidth, InitialHeight, "GAME2005 Michael McKall 101551503");
 	SetTargetFPS(TARGET_FPS);
-	halfspace.position = { 500, 700 };
-	halfspace.staticBody = true;
+	halfspace.position() = { 500, 700 };
+	halfspace.setStatic(true);
+	halfspace.collisionCategory = LAYER_GROUND;
 	halfspace.setRotation(315);
-	pObjects.push_back(&halfspace);
+	addBody(&halfspace);
+
+	physicsCircle* zone = new physicsCircle({ 900, 400 }, { 0, 0 }, 60, 0, 1, SKYBLUE);
+	zone->setStatic(true);
+	zone->sensor = true;
+	addBody(zone);
+	triggerZone = zone->handle;
 
 	/*halfspace2.position = {400, 600};
 	halfspace2.staticBody = true;
+	halfspace2.collisionCategory = LAYER_GROUND;
 	halfspace2.setRotation(45);
-	pObjects.push_back(&halfspace2);*/
+	addBody(&halfspace2);*/
 
 	while (!WindowShouldClose()) // Loops TARGET_FPS times per second
 	{